@@ -0,0 +1,57 @@
+#!/usr/bin/env python3
+# SPDX-License-Identifier: GPL-2.0-or-later
+"""
+Stream start benchmark
+Starts short capture sessions with an unchanged and with an alternating format
+and prints the s_stream(1) latency the driver measured for each start.
+"""
+
+import argparse
+import os
+import subprocess
+import statistics
+
+
+def stream(video, width, height, frames):
+    fmt = "width=%d,height=%d" % (width, height)
+    subprocess.run(["v4l2-ctl", "-d", video, "--set-fmt-video=" + fmt,
+                    "--stream-mmap", "--stream-count=%d" % frames],
+                   check=True, stdout=subprocess.DEVNULL, stderr=subprocess.DEVNULL)
+
+
+def latency(sysfs, name):
+    with open(os.path.join(sysfs, name)) as f:
+        return int(f.read())
+
+
+def run(args, sizes, name):
+    result = []
+    for n in range(args.count):
+        width, height = sizes[n % len(sizes)]
+        stream(args.video, width, height, args.frames)
+        result.append(latency(args.sysfs, name))
+    return result
+
+
+def report(title, values):
+    print("%-10s n=%d  min=%6d us  median=%6d us  max=%6d us" %
+          (title, len(values), min(values), statistics.median(values), max(values)))
+
+
+def main():
+    parser = argparse.ArgumentParser(description="stream start latency benchmark")
+    parser.add_argument('-d', dest='video', default='/dev/video0', help='capture device')
+    parser.add_argument('-s', dest='sysfs', required=True, help='sysfs device path of the camera, e.g. /sys/bus/i2c/devices/2-0038')
+    parser.add_argument('-n', dest='count', type=int, default=10, help='number of stream starts per case')
+    parser.add_argument('-f', dest='frames', type=int, default=5, help='frames per stream start')
+    args = parser.parse_args()
+
+    # first start programs the format, not counted
+    stream(args.video, 1920, 1080, args.frames)
+
+    report("unchanged", run(args, [(1920, 1080)], "stream_start_unchanged_us"))
+    report("changed", run(args, [(1280, 720), (1920, 1080)], "stream_start_changed_us"))
+
+
+if __name__ == "__main__":
+    main()
@@ -13,12 +13,30 @@ SENSOR_TEMP_EN     = 0x04
 GET_SENSOR_TEMP    = 0x05
 
 
+# identity cached by the kernel driver, e.g. /sys/bus/i2c/devices/2-0038
+def sysfs_status(path):
+    def attr(name):
+        with open(os.path.join(path, name)) as f:
+            return f.read().strip()
+
+    print("MCU version = %s" %(attr("mcu_version")))
+    print("NVM version = %s" %(attr("nvm_version")))
+    print("ISP version = %s" %(attr("isp_version")))
+    print("Camera Type = %s" %(attr("camera_type").capitalize()))
+    print("Serial = %s" %(attr("serial")))
+
+
 def main():
 
     parser = argparse.ArgumentParser(description="I2C write",prog="write")
     parser.add_argument('-i', dest='iic', metavar='iic',type=lambda p: p if os.path.exists(p) else FileNotFoundError(p), default='/dev/i2c-0', help='i2c dev path')
+    parser.add_argument('-s', dest='sysfs', metavar='sysfs', default=None, help='sysfs device path, read the identity from the driver without i2c access')
     args = parser.parse_args()
 
+    if args.sysfs:
+        sysfs_status(args.sysfs)
+        return
+
     gsi2c.i2c = I2C(args.iic)
 
     if(gsi2c.bootid() == 0x5AA5):
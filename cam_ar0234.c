@@ -4,6 +4,7 @@
 
 #include <linux/clk.h>
 #include <linux/ctype.h>
+#include <linux/debugfs.h>
 #include <linux/delay.h>
 #include <linux/device.h>
 #include <linux/i2c.h>
@@ -13,6 +14,8 @@
 #include <linux/of_device.h>
 #include <linux/of_gpio.h>
 #include <linux/firmware.h>
+#include <linux/gcd.h>
+#include <linux/pm_runtime.h>
 #include <linux/pinctrl/consumer.h>
 #include <linux/slab.h>
 #include <linux/types.h>
@@ -54,6 +57,30 @@ static char * nvm_firmware_names[MAX_CAMERA_DEVICES];
 module_param_array(nvm_firmware_names, charp, NULL, 0444);
 MODULE_PARM_DESC(devices, "nvm file names");
 
+// keep the ISP powered this long after the last user, so back to back streams skip the power up
+static int autosuspend_delay_ms = 5000;
+module_param(autosuspend_delay_ms, int, 0444);
+MODULE_PARM_DESC(autosuspend_delay_ms, "idle time in ms before the ISP is powered down (-1 = never)");
+
+static bool prestage_format;
+module_param(prestage_format, bool, 0644);
+MODULE_PARM_DESC(prestage_format, "program the output format at set_fmt time instead of at stream on");
+
+// the AE/AWB snapshot behind the volatile controls is refreshed at most this often
+static int volatile_cache_ms = 100;
+module_param(volatile_cache_ms, int, 0644);
+MODULE_PARM_DESC(volatile_cache_ms, "minimum time in ms between reads of the live exposure/gain/white balance values");
+
+static bool ratelimit_sliders = true;
+module_param(ratelimit_sliders, bool, 0644);
+MODULE_PARM_DESC(ratelimit_sliders, "write zoom/pan/tilt/brightness/noise reduction at most once per frame period");
+
+static struct dentry *gs_ar0234_debugfs_root;
+
+static int event_poll_ms = 500;
+module_param(event_poll_ms, int, 0644);
+MODULE_PARM_DESC(event_poll_ms, "while control events are subscribed, check values the firmware changes (AWB mode, AE target, zoom) every this many ms, 0 = off");
+
 
 #ifdef DEBUG
 static int gs_print_params(void)
@@ -71,83 +98,1200 @@ static int gs_print_params(void)
 #endif
 
 
+/*
+ * Output modes of the mainapp, in GS_REG_FORMAT order (see video_format in
+ * ap1302py/examples), with the highest frame rate the ISP delivers per size.
+ */
+static const struct resolution gs_ar0234_modes[] = {
+	{ 1920, 1200,  60,  0, "1920x1200" },
+	{ 1600, 1200,  60,  1, "1600x1200" },
+	{ 1200, 1200,  60,  2, "1200x1200" },
+	{ 1920, 1080,  60,  3, "1920x1080" },
+	{ 1440, 1080,  60,  4, "1440x1080" },
+	{ 1080, 1080,  60,  5, "1080x1080" },
+	{ 1366, 1024,  60,  6, "1366x1024" },
+	{ 1280, 1024,  60,  7, "1280x1024" },
+	{ 1024, 1024,  60,  8, "1024x1024" },
+	{ 1280,  960,  90,  9, "1280x960" },
+	{ 1366,  768,  90, 10, "1366x768" },
+	{ 1024,  768,  90, 11, "1024x768" },
+	{ 1280,  720, 120, 12, "1280x720" },
+	{  960,  720, 120, 13, "960x720" },
+	{ 1024,  576, 120, 14, "1024x576" },
+	{  768,  576, 120, 15, "768x576" },
+	{  960,  540, 120, 16, "960x540" },
+	{  720,  540, 120, 17, "720x540" },
+	{  854,  480, 120, 18, "854x480" },
+	{  640,  480, 120, 19, "640x480" },
+};
+#define GS_DEFAULT_MODE 3 // 1920x1080
+
+/* media bus codes the ISP can output, with bits per pixel on the bus and the GS_REG_FORMAT_TYPE value */
+static const struct gs_ar0234_format gs_ar0234_formats[] = {
+	{ MEDIA_BUS_FMT_YUYV8_1X16, 16, GS_CF_YUV422, 0x1E },		//2011, YUV422 8-bit
+	{ MEDIA_BUS_FMT_RGB888_1X24, 24, GS_CF_RGB_888, 0x24 },	//100a
+	{ MEDIA_BUS_FMT_RGB565_1X16, 16, GS_CF_RGB_565, 0x22 },	//1017
+	{ MEDIA_BUS_FMT_RGB555_2X8_PADHI_LE, 16, GS_CF_RGB_555, 0x21 },	//1004
+	{ MEDIA_BUS_FMT_JPEG_1X8, 8, GS_CF_JPEG422, 0x30 },		// 14001, user defined 1
+	{ MEDIA_BUS_FMT_SRGGB16_1X16, 16, GS_CF_BAYER_16, 0x2E },	//3020
+	{ MEDIA_BUS_FMT_SRGGB12_1X12, 12, GS_CF_BAYER_12, 0x2C },	//3012
+	{ MEDIA_BUS_FMT_SRGGB10_1X10, 10, GS_CF_BAYER_10, 0x2B },	//300f
+	{ MEDIA_BUS_FMT_SRGGB8_1X8, 8, GS_CF_BAYER_8, 0x2A },		//3014
+};
+
+// frame intervals offered below the maximum of a mode, including the 1001 based broadcast rates
+static const struct v4l2_fract gs_ar0234_intervals[] = {
+	{ 1, 120 }, { 1, 90 }, { 1, 60 }, { 1001, 60000 }, { 1, 50 }, { 1, 30 }, { 1001, 30000 },
+	{ 1, 25 }, { 1, 24 }, { 1001, 24000 }, { 1, 15 }, { 1, 10 }, { 1, 5 },
+};
+
+// GS_REG_FRAMERATE holds the frame rate in fps as 8.8 fixed point, i.e. 1/256 fps steps
+#define GS_FPS(fps) ((fps) << 8)
+
+static u32 gs_interval_to_fps(const struct v4l2_fract *interval)
+{
+	return DIV_ROUND_CLOSEST_ULL((u64)interval->denominator << 8, interval->numerator);
+}
+
+static void gs_fps_to_interval(u32 fps, struct v4l2_fract *interval)
+{
+	unsigned long g = gcd(256, fps);
+
+	interval->numerator = 256 / g;
+	interval->denominator = fps / g;
+}
+
+static const struct gs_ar0234_format *gs_ar0234_find_format(u32 code)
+{
+	for (int i = 0; i < ARRAY_SIZE(gs_ar0234_formats); i++)
+		if (gs_ar0234_formats[i].code == code)
+			return &gs_ar0234_formats[i];
+	return NULL;
+}
+
+static const struct resolution *gs_ar0234_find_mode(u32 width, u32 height)
+{
+	for (int i = 0; i < ARRAY_SIZE(gs_ar0234_modes); i++)
+		if (gs_ar0234_modes[i].width == width && gs_ar0234_modes[i].height == height)
+			return &gs_ar0234_modes[i];
+	return NULL;
+}
+
+// CSI-2 payload capacity in bit/s (DDR, all lanes), 10% kept for blanking and packet overhead
+static u64 gs_ar0234_link_bps(struct gs_ar0234_dev *sensor)
+{
+	if (!sensor->num_link_freqs)
+		return 0;
+	return div_u64((u64)sensor->link_freqs[0] * 2 * sensor->ep.bus.mipi_csi2.num_data_lanes * 9, 10);
+}
+
+/*
+ * Highest frame rate (8.8) of a mode in a format. The ISP output is sized for
+ * 16 bit per pixel at the mode rate, and the CSI-2 link from the DT endpoint
+ * has to carry it.
+ */
+static u32 gs_ar0234_max_fps(struct gs_ar0234_dev *sensor, const struct resolution *mode, const struct gs_ar0234_format *format)
+{
+	u64 bps = gs_ar0234_link_bps(sensor);
+	u32 fps;
+
+	if (format->bpp <= 16)
+		fps = GS_FPS(mode->framerate);
+	else
+		fps = GS_FPS(mode->framerate) * 16 / format->bpp;
+
+	if (bps)
+		fps = min_t(u64, fps, div64_u64(bps << 8, (u64)mode->width * mode->height * format->bpp));
+	return fps;
+}
+
+// duration of one frame at the current frame rate
+static ktime_t gs_ar0234_frame_period(struct gs_ar0234_dev *sensor)
+{
+	return ns_to_ktime(div_u64((u64)NSEC_PER_SEC << 8, max_t(u32, sensor->framerate, GS_FPS(1))));
+}
+
+// V4L2_CID_PIXEL_RATE: link_freq * 2 (DDR) * lanes / bpp, or the plain pixel throughput without link info
+static s64 gs_ar0234_pixel_rate(struct gs_ar0234_dev *sensor, const struct gs_ar0234_format *format)
+{
+	if (sensor->num_link_freqs)
+		return div_u64((u64)sensor->link_freqs[0] * 2 * sensor->ep.bus.mipi_csi2.num_data_lanes, format->bpp);
+	return ((u64)sensor->mode->width * sensor->mode->height * sensor->framerate) >> 8;
+}
+
 static int gs_ar0234_i_cntrl(struct gs_ar0234_dev *sensor);
+static int gs_ar0234_sync_ctrls(struct gs_ar0234_dev *sensor);
+static void gs_ar0234_prestage(struct gs_ar0234_dev *sensor);
+
+static inline struct gs_ar0234_dev *to_gs_ar0234_dev(struct v4l2_subdev *sd)
+{
+	return container_of(sd, struct gs_ar0234_dev, sd);
+}
+
+static inline struct v4l2_subdev *ctrl_to_sd(struct v4l2_ctrl *ctrl)
+{
+	return &container_of(ctrl->handler, struct gs_ar0234_dev,
+			     ctrls.handler)->sd;
+}
+
+
+/* --------------- Register shadow --------------- */
+
+/*
+ * Take over the values of a batched read back as both current and firmware
+ * default. A held write is newer than what the ISP has, it keeps its value
+ * and is still written by the next flush.
+ */
+static void gs_shadow_load(struct gs_ar0234_dev *sensor, const struct gs_reg *regs, int num)
+{
+	struct gs_reg_shadow *sh = &sensor->shadow;
+
+	for (int i = 0; i < num; i++) {
+		sh->def[regs[i].addr] = regs[i].val;
+		set_bit(regs[i].addr, sh->has_def);
+		if (test_bit(regs[i].addr, sh->pending))
+			continue;
+		sh->val[regs[i].addr] = regs[i].val;
+		sh->size[regs[i].addr] = regs[i].size;
+		set_bit(regs[i].addr, sh->valid);
+	}
+}
+
+// the register already holds (or is about to get) this value
+static bool gs_shadow_unchanged(struct gs_ar0234_dev *sensor, u8 addr, u8 size, u32 val)
+{
+	struct gs_reg_shadow *sh = &sensor->shadow;
+
+	if (!test_bit(addr, sh->valid) || test_bit(addr, sh->live))
+		return false;
+	if (sh->size[addr] != size || sh->val[addr] != val)
+		return false;
+
+	sh->suppressed++;
+	return true;
+}
+
+// record a value that is written to the ISP later, by gs_shadow_flush()
+static void gs_shadow_hold(struct gs_ar0234_dev *sensor, u8 addr, u8 size, u32 val)
+{
+	struct gs_reg_shadow *sh = &sensor->shadow;
+
+	sh->val[addr] = val;
+	sh->size[addr] = size;
+	set_bit(addr, sh->valid);
+	set_bit(addr, sh->pending);
+}
+
+/*
+ * Sliders can be moved far faster than the ISP takes new values. Within one
+ * frame period of the last write the value is only held, ratelimit_timer
+ * writes the latest one when the period is over.
+ */
+static bool gs_ctrl_throttled(struct gs_ar0234_dev *sensor, u8 addr)
+{
+	struct gs_reg_shadow *sh = &sensor->shadow;
+	ktime_t next;
+
+	if (!ratelimit_sliders || !test_bit(addr, sh->ratelimited))
+		return false;
+
+	next = ktime_add(sh->stamp[addr], gs_ar0234_frame_period(sensor));
+	if (!ktime_before(ktime_get(), next))
+		return false;
+
+	if (!hrtimer_active(&sensor->ratelimit_timer))
+		hrtimer_start(&sensor->ratelimit_timer, next, HRTIMER_MODE_ABS);
+	return true;
+}
+
+/*
+ * Write a control register and remember the value, so it can be replayed later.
+ * While runtime PM has the ISP powered down the value is only recorded, the
+ * runtime resume path writes all pending registers in one batch. While a
+ * store/restore command runs the same happens, cmd_work commits them when done.
+ */
+static int gs_ctrl_write(struct gs_ar0234_dev *sensor, u8 addr, u8 size, u32 val)
+{
+	struct gs_reg_shadow *sh = &sensor->shadow;
+	int ret;
+
+	// GUIs re-apply whole control sets, keep those off the bus
+	if (gs_shadow_unchanged(sensor, addr, size, val))
+		return 0;
+
+	if (!sensor->powered || sensor->cmd || gs_ctrl_throttled(sensor, addr)) {
+		gs_shadow_hold(sensor, addr, size, val);
+		dev_dbg_ratelimited(sensor->dev, "%s: deferred reg %02x = %x\n", __func__, addr, val);
+		return 0;
+	}
+
+	switch (size) {
+		case 4:		ret = gs_ar0234_write_reg32(sensor, addr, val); break;
+		case 2:		ret = gs_ar0234_write_reg16(sensor, addr, val); break;
+		default:	ret = gs_ar0234_write_reg8(sensor, addr, val); break;
+	}
+	if (ret)
+		return ret;
+
+	sh->val[addr] = val;
+	sh->size[addr] = size;
+	sh->stamp[addr] = ktime_get();
+	set_bit(addr, sh->valid);
+	clear_bit(addr, sh->pending);
+	return 0;
+}
+
+// take over registers that just went out to the ISP
+static void gs_shadow_written(struct gs_ar0234_dev *sensor, const struct gs_reg *regs, int num)
+{
+	struct gs_reg_shadow *sh = &sensor->shadow;
+	ktime_t now = ktime_get();
+
+	for (int i = 0; i < num; i++) {
+		sh->val[regs[i].addr] = regs[i].val;
+		sh->size[regs[i].addr] = regs[i].size;
+		sh->stamp[regs[i].addr] = now;
+		set_bit(regs[i].addr, sh->valid);
+		clear_bit(regs[i].addr, sh->pending);
+	}
+}
+
+/*
+ * Several control registers in one multi-message transfer, so a cluster of
+ * controls (e.g. exposure mode, time and gain) lands on the same frame.
+ */
+static int gs_ctrl_write_batch(struct gs_ar0234_dev *sensor, const struct gs_reg *regs, int num)
+{
+	int i, ret;
+
+	if (num == 1 || !sensor->powered || sensor->cmd) {
+		for (i = 0; i < num; i++) {
+			ret = gs_ctrl_write(sensor, regs[i].addr, regs[i].size, regs[i].val);
+			if (ret)
+				return ret;
+		}
+		return 0;
+	}
+
+	// a throttled member holds back the whole batch, it stays one transfer
+	for (i = 0; i < num; i++)
+		if (gs_ctrl_throttled(sensor, regs[i].addr))
+			break;
+	if (i < num) {
+		for (i = 0; i < num; i++)
+			gs_shadow_hold(sensor, regs[i].addr, regs[i].size, regs[i].val);
+		return 0;
+	}
+
+	ret = gs_ar0234_write_regs(sensor, regs, num);
+	if (ret)
+		return ret;
+
+	gs_shadow_written(sensor, regs, num);
+	return 0;
+}
+
+static inline int gs_ctrl_write8(struct gs_ar0234_dev *sensor, u8 addr, u8 val)
+{
+	return gs_ctrl_write(sensor, addr, 1, val);
+}
+
+static inline int gs_ctrl_write16(struct gs_ar0234_dev *sensor, u8 addr, u16 val)
+{
+	return gs_ctrl_write(sensor, addr, 2, val);
+}
+
+static inline int gs_ctrl_write32(struct gs_ar0234_dev *sensor, u8 addr, u32 val)
+{
+	return gs_ctrl_write(sensor, addr, 4, val);
+}
+
+// read-modify-write base value, from the shadow so a sleeping ISP isn't touched
+static int gs_ctrl_read8(struct gs_ar0234_dev *sensor, u8 addr, u8 *val)
+{
+	if (test_bit(addr, sensor->shadow.valid)) {
+		*val = sensor->shadow.val[addr];
+		return 0;
+	}
+	return gs_ar0234_read_reg8(sensor, addr, val);
+}
+
+// mark every register that no longer holds its firmware default for replay
+static int gs_shadow_mark_dirty(struct gs_ar0234_dev *sensor)
+{
+	struct gs_reg_shadow *sh = &sensor->shadow;
+	int addr;
+
+	for_each_set_bit(addr, sh->valid, GS_NUM_REGS)
+		if (!test_bit(addr, sh->has_def) || sh->val[addr] != sh->def[addr])
+			set_bit(addr, sh->pending);
+
+	return bitmap_weight(sh->pending, GS_NUM_REGS);
+}
+
+/*
+ * Write all pending registers in one batched transfer. Registers go out in
+ * address order, which puts the mode registers (exposure, white balance,
+ * anti flicker) before the values that depend on them.
+ * Must be called with sensor->lock held and the ISP powered.
+ */
+static int gs_shadow_flush(struct gs_ar0234_dev *sensor)
+{
+	struct gs_reg_shadow *sh = &sensor->shadow;
+	struct gs_reg *regs;
+	int addr, i, num = 0, ret;
+
+	if (bitmap_empty(sh->pending, GS_NUM_REGS))
+		return 0;
+
+	regs = kcalloc(bitmap_weight(sh->pending, GS_NUM_REGS), sizeof(*regs), GFP_KERNEL);
+	if (!regs)
+		return -ENOMEM;
+
+	for_each_set_bit(addr, sh->pending, GS_NUM_REGS) {
+		regs[num].addr = addr;
+		regs[num].size = sh->size[addr];
+		regs[num].val = sh->val[addr];
+		num++;
+	}
+
+	ret = gs_ar0234_write_regs(sensor, regs, num);
+	if (!ret) {
+		for (i = 0; i < num; i++)
+			sh->stamp[regs[i].addr] = ktime_get();
+		bitmap_zero(sh->pending, GS_NUM_REGS);
+	}
+	dev_dbg(sensor->dev, "%s: %d registers, ret %d\n", __func__, num, ret);
+
+	kfree(regs);
+	return ret;
+}
+
+/*
+ * Commands (push to white, store/restore registers, reboot) and read backs need
+ * a running ISP. They run with sensor->lock held, which the runtime PM
+ * callbacks take as well, so a sleeping ISP is powered up directly for the
+ * duration of the access (pending writes go out first) and put back to sleep.
+ */
+static int gs_ctrl_wake(struct gs_ar0234_dev *sensor, bool *woken)
+{
+	int ret;
+
+	*woken = false;
+	if (sensor->powered)
+		return 0;
+
+	ret = gs_ar0234_power(sensor, GS_POWER_UP);
+	if (ret)
+		return ret;
+	sensor->powered = true;
+	*woken = true;
+
+	return gs_shadow_flush(sensor);
+}
+
+static void gs_ctrl_sleep(struct gs_ar0234_dev *sensor, bool woken)
+{
+	if (!woken)
+		return;
+
+	if (gs_ar0234_power(sensor, GS_POWER_DOWN) == 0)
+		sensor->powered = false;
+	sensor->programmed.valid = false;
+}
+
+/* --------------- Subdev Operations --------------- */
+
+// legacy bridges still call .s_power, map it onto runtime PM references
+static int gs_ar0234_s_power(struct v4l2_subdev *sd, int on)
+{
+	int ret=0;
+	struct gs_ar0234_dev *sensor = to_gs_ar0234_dev(sd);
+	dev_dbg(sensor->dev, "%s: %s\n", __func__, on ? "up" : "down");
+
+	if (on) {
+		ret = pm_runtime_resume_and_get(sensor->dev);
+		if (ret < 0)
+			return ret;
+		sensor->power_count++;
+	}
+	else if (sensor->power_count > 0) {
+		sensor->power_count--;
+		pm_runtime_mark_last_busy(sensor->dev);
+		pm_runtime_put_autosuspend(sensor->dev);
+	}
+	return 0;
+}
+
+static int ops_get_fmt(struct v4l2_subdev *sub_dev, struct v4l2_subdev_state *sd_state, struct v4l2_subdev_format *format)
+{
+	struct gs_ar0234_dev *sensor = to_gs_ar0234_dev(sub_dev);
+	struct v4l2_mbus_framefmt *fmt;
+
+	dev_dbg(sub_dev->dev, "-> %s: pad: %d\n", __func__, format->pad);
+	if (format->pad >= NUM_PADS)
+		return -EINVAL;
+
+	if (format->which == V4L2_SUBDEV_FORMAT_TRY)
+		fmt = v4l2_subdev_get_try_format(&sensor->sd, sd_state, format->pad);
+	else
+		fmt = &sensor->fmt;
+
+	format->format = *fmt;
+	dev_dbg(sub_dev->dev, "<- %s: %dx%d\n", __func__, fmt->width, fmt->height);
+
+	return 0;
+}
+
+// GS_REG_FORMAT_TYPE for the active code, JPEG picks 4:2:2 or 4:2:0 from the chroma subsampling control
+static void gs_ar0234_update_format_type(struct gs_ar0234_dev *sensor, int subsampling)
+{
+	const struct gs_ar0234_format *format = gs_ar0234_find_format(sensor->fmt.code);
+
+	sensor->format_type = format->colorformat;
+	if (format->colorformat == GS_CF_JPEG422 && subsampling == V4L2_JPEG_CHROMA_SUBSAMPLING_420)
+		sensor->format_type = GS_CF_JPEG420;
+}
+
+static int gs_ar0234_set_fmt(struct v4l2_subdev *sd, struct v4l2_subdev_state *sd_state, struct v4l2_subdev_format *format)
+{
+	struct gs_ar0234_dev *sensor = to_gs_ar0234_dev(sd);
+	struct v4l2_mbus_framefmt *fmt = &format->format;
+	const struct resolution *mode;
+	const struct gs_ar0234_format *format_info;
+	u32 max_fps;
+	int ret=0;
+
+	dev_dbg(sensor->dev, "%s %dx%d 0x%04x\n",__func__, fmt->width, fmt->height, fmt->code);
+
+	if (format->pad >= NUM_PADS)
+		return -EINVAL;
+
+	// snap to the closest mode the ISP supports
+	mode = v4l2_find_nearest_size(gs_ar0234_modes, ARRAY_SIZE(gs_ar0234_modes), width, height, fmt->width, fmt->height);
+	fmt->width = mode->width;
+	fmt->height = mode->height;
+	format_info = gs_ar0234_find_format(fmt->code);
+	if (!format_info) {
+		fmt->code = sensor->fmt.code;
+		format_info = gs_ar0234_find_format(fmt->code);
+	}
+
+	// the frame rate is clamped to what the link carries, a mode/format that can't reach 1 fps is refused
+	max_fps = gs_ar0234_max_fps(sensor, mode, format_info);
+	if (max_fps < GS_FPS(1)) {
+		dev_dbg(sensor->dev, "%s: %dx%d 0x%04x exceeds the link bandwidth\n", __func__, fmt->width, fmt->height, fmt->code);
+		return -EINVAL;
+	}
+	fmt->field = V4L2_FIELD_NONE;
+	fmt->colorspace = sensor->fmt.colorspace;
+	fmt->ycbcr_enc = sensor->fmt.ycbcr_enc;
+	fmt->quantization = sensor->fmt.quantization;
+	fmt->xfer_func = sensor->fmt.xfer_func;
+
+	if (format->which == V4L2_SUBDEV_FORMAT_TRY) {
+		*v4l2_subdev_get_try_format(sd, sd_state, format->pad) = *fmt;
+		return 0;
+	}
+
+	mutex_lock(&sensor->lock);
+	if (sensor->streaming && (mode != sensor->mode || fmt->code != sensor->fmt.code)) {
+		ret = -EBUSY;
+		goto exit;
+	}
+
+	sensor->fmt = *fmt;
+	sensor->mode = mode;
+	gs_ar0234_update_format_type(sensor, sensor->ctrls.jpeg_subsampling->cur.val);
+	if (sensor->framerate > max_fps)
+		sensor->framerate = max_fps;
+	__v4l2_ctrl_s_ctrl_int64(sensor->ctrls.pixel_rate, gs_ar0234_pixel_rate(sensor, format_info));
+
+	pr_debug("%s: sensor->fmt.height  = %d\n", __func__, sensor->fmt.height);
+	pr_debug("%s: sensor->fmt.width   = %d\n", __func__, sensor->fmt.width);
+	pr_debug("%s: sensor->framerate   = %d.%02d\n", __func__, sensor->framerate >> 8, (sensor->framerate & 0xff) * 100 / 256);
+	pr_debug("%s: mode                = %s (%d)\n", __func__, mode->name, mode->frame_format_code);
+	pr_debug("%s: sensor->format_type = %d\n", __func__, sensor->format_type);
+exit:
+	mutex_unlock(&sensor->lock);
+
+	if (ret == 0)
+		gs_ar0234_prestage(sensor);
+	return ret;
+}
+
+/* --------------- Control descriptors --------------- */
+
+// exposure times are in 100 us units on the V4L2 side and in us in the ISP
+static u32 gs_exposure_to_reg(s32 val)
+{
+	return val * 100;
+}
+
+static s32 gs_exposure_from_reg(u32 reg)
+{
+	return reg / 100;
+}
+
+// AE target: 1/1000 units to s7.8
+static u32 gs_ae_target_to_reg(s32 val)
+{
+	u16 tmp = (u16) (val * 256 / 1000);  // reverse = val * 1000 / 256
+
+	return val < 0 ? tmp - ((val%1000) > -500 ? 0 : 1) : tmp + ((val%1000) < 500 ? 0 : 1); // rounding
+}
+
+static s32 gs_ae_target_from_reg(u32 reg)
+{
+	return ((s32) (s16) reg) * 1000 / 256;
+}
+
+static u32 gs_exposure_mode_to_reg(s32 val)
+{
+	switch (val) {
+		case V4L2_EXPOSURE_MANUAL:			return 0x0; // Manual Exposure, manual Gain
+		case V4L2_EXPOSURE_SHUTTER_PRIORITY:	return 0x9; // Auto BV, Manual Exposure, Auto Gain
+		case V4L2_EXPOSURE_APERTURE_PRIORITY:	return 0xC; //  For now use same as Auto
+		case V4L2_EXPOSURE_AUTO:
+		default:					return 0xC; // Auto Brightness/Exposure/Gain
+	}
+}
+
+static s32 gs_exposure_mode_from_reg(u32 reg)
+{
+	switch (reg) {
+		case 0x0:	return V4L2_EXPOSURE_MANUAL;
+		case 0x9:	return V4L2_EXPOSURE_SHUTTER_PRIORITY;
+		default:	return V4L2_EXPOSURE_AUTO;
+	}
+}
+
+// GS_REG_BLC_MODE uses the V4L2 metering values, 3 selects the 8 weight table
+static s32 gs_metering_from_reg(u32 reg)
+{
+	return reg <= V4L2_EXPOSURE_METERING_MATRIX ? reg : V4L2_EXPOSURE_METERING_CENTER_WEIGHTED;
+}
+
+// only OFF and ON, OFF controls AWB with the temperature
+static u32 gs_auto_wb_to_reg(s32 val)
+{
+	return val == 0 ? 0x7 : 0xF;
+}
+
+static s32 gs_auto_wb_from_reg(u32 reg)
+{
+	return (reg & 0x0F) == 0x0F ? 1 : 0;
+}
+
+static s32 gs_wb_preset_from_reg(u32 reg)
+{
+	if (reg == 0)		return V4L2_WHITE_BALANCE_MANUAL;
+	if (reg <= 3500)	return V4L2_WHITE_BALANCE_INCANDESCENT;
+	if (reg <= 4500)	return V4L2_WHITE_BALANCE_FLUORESCENT;
+	if (reg <= 5000)	return V4L2_WHITE_BALANCE_FLUORESCENT_H;
+	if (reg <= 6000)	return V4L2_WHITE_BALANCE_HORIZON;
+	if (reg <= 7000)	return V4L2_WHITE_BALANCE_DAYLIGHT;
+	if (reg <= 8000)	return V4L2_WHITE_BALANCE_CLOUDY;
+	return V4L2_WHITE_BALANCE_SHADE;
+}
+
+// V4L2 color effect to GS_REG_COLORFX, 0 for the effects the ISP doesn't have
+static const u8 gs_colorfx_regs[] = {
+	[V4L2_COLORFX_NONE]		= 0x00,
+	[V4L2_COLORFX_BW]		= 0x03,
+	[V4L2_COLORFX_SEPIA]		= 0x0D,
+	[V4L2_COLORFX_NEGATIVE]		= 0x07,
+	[V4L2_COLORFX_EMBOSS]		= 0x05,
+	[V4L2_COLORFX_SKETCH]		= 0x0F,
+	[V4L2_COLORFX_SKY_BLUE]		= 0x08,
+	[V4L2_COLORFX_GRASS_GREEN]	= 0x09,
+	[V4L2_COLORFX_ART_FREEZE]	= 0x11, // foggy
+	[V4L2_COLORFX_SILHOUETTE]	= 0x04, //emboss B/W
+	[V4L2_COLORFX_SOLARIZATION]	= 0x10,
+	[V4L2_COLORFX_ANTIQUE]		= 0x02,
+	[V4L2_COLORFX_SET_CBCR]		= 0x00,
+};
+
+static u32 gs_colorfx_to_reg(s32 val)
+{
+	return val >= 0 && val < ARRAY_SIZE(gs_colorfx_regs) ? gs_colorfx_regs[val] : 0;
+}
+
+static s32 gs_colorfx_from_reg(u32 reg)
+{
+	for (int i = 1; i < ARRAY_SIZE(gs_colorfx_regs); i++)
+		if (gs_colorfx_regs[i] == reg)
+			return i;
+	return V4L2_COLORFX_NONE;
+}
+
+#define GS_CLUSTER_MAX	4	/* largest control cluster, see gs_ar0234_init_controls() */
+
+#define GS_CTRL_DESC(_id, _ctrl, _reg, _size, ...) \
+	{ .id = _id, .ctrl = offsetof(struct gs_ar0234_ctrls, _ctrl), .reg = _reg, .size = _size, __VA_ARGS__ }
+#define GS_CTRL_BIT(_id, _ctrl, _reg, _bit) \
+	GS_CTRL_DESC(_id, _ctrl, _reg, 1, .shift = _bit, .mask = 0x01)
+
+/*
+ * Every control that maps onto control registers. s_ctrl writes and
+ * gs_ar0234_i_cntrl() reads back through this table, commands and controls
+ * spanning several registers keep their own code.
+ */
+static const struct gs_ctrl_desc gs_ar0234_ctrl_descs[] = {
+	GS_CTRL_DESC(V4L2_CID_BRIGHTNESS, brightness, GS_REG_BRIGHTNESS, 2, .flags = GS_CTRL_SIGNED | GS_CTRL_RATE_LIMIT),
+	GS_CTRL_DESC(V4L2_CID_CONTRAST, contrast, GS_REG_CONTRAST, 2, .flags = GS_CTRL_SIGNED),
+	GS_CTRL_DESC(V4L2_CID_SATURATION, saturation, GS_REG_SATURATION, 2),
+	GS_CTRL_DESC(V4L2_CID_GAMMA, gamma, GS_REG_GAMMA, 2),
+	GS_CTRL_DESC(V4L2_CID_SHARPNESS, sharpness, GS_REG_SHARPNESS, 2, .flags = GS_CTRL_SIGNED),
+	GS_CTRL_DESC(V4L2_CID_NOISE_RED, noise_red, GS_REG_NOISE_RED, 2, .flags = GS_CTRL_SIGNED | GS_CTRL_RATE_LIMIT),
+	// push to white leaves AWB in manual mode
+	GS_CTRL_DESC(V4L2_CID_AUTO_WHITE_BALANCE, auto_wb, GS_REG_WHITEBALANCE, 1, .flags = GS_CTRL_FW_DRIVEN, .to_reg = gs_auto_wb_to_reg, .from_reg = gs_auto_wb_from_reg),
+	GS_CTRL_DESC(V4L2_CID_WHITE_BALANCE_TEMPERATURE, wb_temp, GS_REG_WB_TEMPERATURE, 2, .flags = GS_CTRL_VOLATILE),
+	GS_CTRL_DESC(V4L2_CID_AUTO_N_PRESET_WHITE_BALANCE, wb_preset, GS_REG_WB_TEMPERATURE, 2, .flags = GS_CTRL_CUSTOM_WRITE, .from_reg = gs_wb_preset_from_reg),
+	GS_CTRL_DESC(V4L2_CID_AWB_MAN_X, awb_man_x, GS_REG_AWB_MAN_X, 2, .flags = GS_CTRL_SIGNED),
+	GS_CTRL_DESC(V4L2_CID_AWB_MAN_Y, awb_man_y, GS_REG_AWB_MAN_Y, 2, .flags = GS_CTRL_SIGNED),
+	GS_CTRL_DESC(V4L2_CID_EXPOSURE_AUTO, auto_exp, GS_REG_EXPOSURE_MODE, 1, .to_reg = gs_exposure_mode_to_reg, .from_reg = gs_exposure_mode_from_reg),
+	GS_CTRL_DESC(V4L2_CID_EXPOSURE_ABSOLUTE, exposure_absolute, GS_REG_EXPOSURE_ABS, 4, .flags = GS_CTRL_VOLATILE, .to_reg = gs_exposure_to_reg, .from_reg = gs_exposure_from_reg),
+	GS_CTRL_DESC(V4L2_CID_EXPOSURE, exposure, GS_REG_AE_TARGET, 2, .flags = GS_CTRL_FW_DRIVEN, .to_reg = gs_ae_target_to_reg, .from_reg = gs_ae_target_from_reg),
+	GS_CTRL_DESC(V4L2_CID_EXPOSURE_UPPER, exposure_upper, GS_REG_EXPOSURE_UPPER, 4, .to_reg = gs_exposure_to_reg, .from_reg = gs_exposure_from_reg),
+	GS_CTRL_DESC(V4L2_CID_EXPOSURE_MAX, exposure_max, GS_REG_EXPOSURE_MAX, 4, .to_reg = gs_exposure_to_reg, .from_reg = gs_exposure_from_reg),
+	GS_CTRL_DESC(V4L2_CID_GAIN_UPPER, gain_upper, GS_REG_GAIN_UPPER, 2),
+	GS_CTRL_DESC(V4L2_CID_GAIN_MAX, gain_max, GS_REG_GAIN_MAX, 2),
+	GS_CTRL_DESC(V4L2_CID_GAIN, gain, GS_REG_GAIN, 2, .flags = GS_CTRL_VOLATILE),
+	GS_CTRL_DESC(V4L2_CID_EXPOSURE_METERING, exposure_metering, GS_REG_BLC_MODE, 1, .from_reg = gs_metering_from_reg),
+	GS_CTRL_DESC(V4L2_CID_BACKLIGHT_COMPENSATION, blc_level, GS_REG_BLC_LEVEL, 1),
+	GS_CTRL_DESC(V4L2_CID_BLC_WINDOW_X0, blc_window_x0, GS_REG_BLC_WINDOW_X0, 1),
+	GS_CTRL_DESC(V4L2_CID_BLC_WINDOW_Y0, blc_window_y0, GS_REG_BLC_WINDOW_Y0, 1),
+	GS_CTRL_DESC(V4L2_CID_BLC_WINDOW_X1, blc_window_x1, GS_REG_BLC_WINDOW_X1, 1),
+	GS_CTRL_DESC(V4L2_CID_BLC_WINDOW_Y1, blc_window_y1, GS_REG_BLC_WINDOW_Y1, 1),
+	GS_CTRL_DESC(V4L2_CID_BLC_RATIO, blc_ratio, GS_REG_BLC_RATIO, 1),
+	GS_CTRL_DESC(V4L2_CID_BLC_FACE_LEVEL, blc_face_level, GS_REG_BLC_FACE_LEVEL, 1),
+	GS_CTRL_DESC(V4L2_CID_BLC_FACE_WEIGHT, blc_face_weight, GS_REG_BLC_FACE_WEIGHT, 1),
+	GS_CTRL_DESC(V4L2_CID_BLC_ROI_LEVEL, blc_roi_level, GS_REG_BLC_ROI_LEVEL, 1),
+	GS_CTRL_BIT(V4L2_CID_FACE_DETECT_0, face_detect_0, GS_REG_FACE_DETECT, 0),
+	GS_CTRL_BIT(V4L2_CID_FACE_DETECT_4, face_detect_4, GS_REG_FACE_DETECT, 4),
+	GS_CTRL_BIT(V4L2_CID_FACE_DETECT_5, face_detect_5, GS_REG_FACE_DETECT, 5),
+	GS_CTRL_DESC(V4L2_CID_FACE_DETECT_SPEED, face_detect_speed, GS_REG_FACE_DETECT_SPEED, 1),
+	GS_CTRL_DESC(V4L2_CID_FACE_DETECT_THRESHOLD, face_detect_threshold, GS_REG_FACE_DETECT_THRESHOLD, 1),
+	GS_CTRL_DESC(V4L2_CID_FACE_CHROMA_THRESHOLD, face_chroma_threshold, GS_REG_FACE_CHROMA_THRESHOLD, 1),
+	GS_CTRL_DESC(V4L2_CID_FACE_MIN_SIZE, face_min_size, GS_REG_FACE_MIN_SIZE, 2),
+	GS_CTRL_DESC(V4L2_CID_FACE_MAX_SIZE, face_max_size, GS_REG_FACE_MAX_SIZE, 2),
+	// mirror is bit[0], flip is bit[1]
+	GS_CTRL_BIT(V4L2_CID_HFLIP, hflip, GS_REG_MIRROR_FLIP, 0),
+	GS_CTRL_BIT(V4L2_CID_VFLIP, vflip, GS_REG_MIRROR_FLIP, 1),
+	GS_CTRL_DESC(V4L2_CID_COLORFX, colorfx, GS_REG_COLORFX, 1, .to_reg = gs_colorfx_to_reg, .from_reg = gs_colorfx_from_reg),
+	GS_CTRL_DESC(V4L2_CID_TEST_PATTERN, testpattern, GS_REG_TESTPATTERN, 1),
+	GS_CTRL_DESC(V4L2_CID_ZOOM_ABSOLUTE, zoom, GS_REG_ZOOM, 2, .flags = GS_CTRL_RATE_LIMIT),
+	GS_CTRL_DESC(V4L2_CID_ZOOM_SPEED, zoom_speed, GS_REG_ZOOM_SPEED, 1, .flags = GS_CTRL_SIGNED),
+	GS_CTRL_DESC(V4L2_CID_ZOOM_CURRENT, zoom_current, GS_REG_ZOOM_CURRENT, 2, .flags = GS_CTRL_VOLATILE | GS_CTRL_FW_DRIVEN),
+	GS_CTRL_DESC(V4L2_CID_PAN_ABSOLUTE, pan, GS_REG_PAN, 1, .flags = GS_CTRL_RATE_LIMIT),
+	GS_CTRL_DESC(V4L2_CID_TILT_ABSOLUTE, tilt, GS_REG_TILT, 1, .flags = GS_CTRL_RATE_LIMIT),
+	GS_CTRL_BIT(V4L2_CID_ROI_MODE_0, roi_mode_0, GS_REG_ROI_MODE, 0),
+	GS_CTRL_BIT(V4L2_CID_ROI_MODE_1, roi_mode_1, GS_REG_ROI_MODE, 1),
+	GS_CTRL_BIT(V4L2_CID_ROI_MODE_2, roi_mode_2, GS_REG_ROI_MODE, 2),
+};
+
+static u32 gs_reg_find(const struct gs_reg *regs, int num, u8 addr)
+{
+	for (int i = 0; i < num; i++)
+		if (regs[i].addr == addr)
+			return regs[i].val;
+	return 0;
+}
+
+static inline struct v4l2_ctrl *gs_desc_ctrl(struct gs_ar0234_ctrls *ctrls, const struct gs_ctrl_desc *desc)
+{
+	return *(struct v4l2_ctrl **)((u8 *)ctrls + desc->ctrl);
+}
+
+// register value as read from the ISP to control value
+static s32 gs_ctrl_desc_decode(const struct gs_ctrl_desc *desc, u32 reg)
+{
+	if (desc->mask)
+		reg = (reg >> desc->shift) & desc->mask;
+	if (desc->from_reg)
+		return desc->from_reg(reg);
+	if (desc->flags & GS_CTRL_SIGNED)
+		return desc->size == 1 ? (s8) reg : desc->size == 2 ? (s16) reg : (s32) reg;
+	return reg;
+}
+
+/*
+ * Control value to register value. Bit fields are merged into old, or into the
+ * shadowed register when old is NULL.
+ */
+static int gs_ctrl_desc_encode(struct gs_ar0234_dev *sensor, const struct gs_ctrl_desc *desc, s32 val, const u32 *old, u32 *reg)
+{
+	u32 field = desc->to_reg ? desc->to_reg(val) : (u32) val;
+	u8 base;
+	int ret;
+
+	if (desc->size < 4)
+		field &= (1U << (desc->size * 8)) - 1;
+	if (!desc->mask) {
+		*reg = field;
+		return 0;
+	}
+
+	if (old) {
+		base = *old;
+	} else {
+		ret = gs_ctrl_read8(sensor, desc->reg, &base);
+		if (ret)
+			return ret;
+	}
+	*reg = (base & ~(desc->mask << desc->shift)) | ((field & desc->mask) << desc->shift);
+	return 0;
+}
+
+static int gs_ctrl_desc_write(struct gs_ar0234_dev *sensor, const struct gs_ctrl_desc *desc, s32 val)
+{
+	u32 reg;
+	int ret;
+
+	ret = gs_ctrl_desc_encode(sensor, desc, val, NULL, &reg);
+	if (ret)
+		return ret;
+	return gs_ctrl_write(sensor, desc->reg, desc->size, reg);
+}
+
+/*
+ * Commit the changed controls of a cluster in one transfer. Controls sharing a
+ * register (hflip/vflip) are merged into a single write.
+ */
+static int gs_ctrl_cluster_write(struct gs_ar0234_dev *sensor, struct v4l2_ctrl *master)
+{
+	const struct gs_ctrl_desc *desc;
+	struct gs_reg regs[GS_CLUSTER_MAX];
+	struct v4l2_ctrl *ctrl;
+	int i, j, num = 0, ret;
+
+	for (i = 0; i < master->ncontrols && num < ARRAY_SIZE(regs); i++) {
+		ctrl = master->cluster[i];
+		if (!ctrl || !ctrl->is_new)
+			continue;
+		desc = ctrl->priv;
+		if (!desc || (desc->flags & GS_CTRL_CUSTOM_WRITE))
+			continue;
+
+		for (j = 0; j < num; j++)
+			if (regs[j].addr == desc->reg)
+				break;
+		ret = gs_ctrl_desc_encode(sensor, desc, ctrl->val, j < num ? &regs[j].val : NULL, &regs[j].val);
+		if (ret)
+			return ret;
+		if (j == num && gs_shadow_unchanged(sensor, desc->reg, desc->size, regs[j].val))
+			continue;
+		if (j == num) {
+			regs[num].addr = desc->reg;
+			regs[num].size = desc->size;
+			num++;
+		}
+		dev_dbg_ratelimited(sensor->dev, "%s: set %s to %d\n", __func__, ctrl->name, ctrl->val);
+	}
+
+	return gs_ctrl_write_batch(sensor, regs, num);
+}
+
+// link the controls to their descriptors, s_ctrl and g_volatile_ctrl find them in ctrl->priv
+static void gs_ar0234_bind_ctrl_descs(struct gs_ar0234_dev *sensor)
+{
+	struct gs_ctrl_snapshot *snap = &sensor->snapshot;
+	const struct gs_ctrl_desc *desc;
+	struct v4l2_ctrl *ctrl;
+
+	for (desc = gs_ar0234_ctrl_descs; desc < gs_ar0234_ctrl_descs + ARRAY_SIZE(gs_ar0234_ctrl_descs); desc++) {
+		ctrl = gs_desc_ctrl(&sensor->ctrls, desc);
+		if (!ctrl)
+			continue;
+		ctrl->priv = (void *) desc;
+		if (desc->flags & GS_CTRL_RATE_LIMIT)
+			set_bit(desc->reg, sensor->shadow.ratelimited);
+		// the firmware moves these, the shadow can't tell a write is redundant
+		if (desc->flags & GS_CTRL_FW_DRIVEN)
+			set_bit(desc->reg, sensor->shadow.live);
+		if (!(desc->flags & GS_CTRL_VOLATILE) || snap->num == GS_SNAPSHOT_REGS)
+			continue;
+		// the core skips s_ctrl for volatile controls unless they execute on write
+		ctrl->flags |= V4L2_CTRL_FLAG_VOLATILE | V4L2_CTRL_FLAG_EXECUTE_ON_WRITE;
+		set_bit(desc->reg, sensor->shadow.live);
+		snap->regs[snap->num].addr = desc->reg;
+		snap->regs[snap->num].size = desc->size;
+		snap->num++;
+	}
+}
+
+/*
+ * Refresh the live AE/AWB values in one batched read, unless the last read is
+ * less than volatile_cache_ms old. All readers share the result, so a daemon
+ * polling at frame rate costs one transfer per cache period.
+ */
+static int gs_ctrl_snapshot_update(struct gs_ar0234_dev *sensor)
+{
+	struct gs_ctrl_snapshot *snap = &sensor->snapshot;
+	ktime_t now = ktime_get();
+	int ret;
+
+	if (snap->valid && ktime_before(now, ktime_add(snap->stamp, ms_to_ktime(max(volatile_cache_ms, 0)))))
+		return 0;
+
+	ret = gs_ar0234_read_regs(sensor, snap->regs, snap->num);
+	if (ret < 0)
+		return ret;
+	snap->stamp = now;
+	snap->valid = true;
+	return 0;
+}
+
+/*
+ * PTZ trajectories. With a PTZ speed set, zoom/pan/tilt are targets: the
+ * engine steps the registers towards them once per frame period, at up to the
+ * axis speed and ramping up and down over PTZ ramp time. The ISP's own zoom
+ * speed still applies on top of every step. Progress shows in zoom current.
+ */
+static const struct gs_reg gs_ptz_regs[GS_PTZ_AXES] = {
+	[GS_PTZ_ZOOM] = { GS_REG_ZOOM, 2 },
+	[GS_PTZ_PAN] = { GS_REG_PAN, 1 },
+	[GS_PTZ_TILT] = { GS_REG_TILT, 1 },
+};
+
+static s32 gs_ptz_speed(struct gs_ar0234_dev *sensor, int axis)
+{
+	struct gs_ar0234_ctrls *ctrls = &sensor->ctrls;
+
+	switch (axis) {
+	case GS_PTZ_ZOOM:	return ctrls->ptz_zoom_speed->cur.val;
+	case GS_PTZ_PAN:	return ctrls->ptz_pan_speed->cur.val;
+	default:		return ctrls->ptz_tilt_speed->cur.val;
+	}
+}
+
+static bool gs_ptz_enabled(struct gs_ar0234_dev *sensor)
+{
+	for (int i = 0; i < GS_PTZ_AXES; i++)
+		if (gs_ptz_speed(sensor, i))
+			return true;
+	return false;
+}
+
+/*
+ * Take over a value the ISP already has, without writing it again. Updates
+ * the cached control value and sends its control event. The core never sees
+ * a volatile control change, so the flag is dropped for the update.
+ */
+static int gs_ctrl_update(struct gs_ar0234_dev *sensor, struct v4l2_ctrl *ctrl, s32 val)
+{
+	u32 flags = ctrl->flags;
+	int ret;
+
+	// EXECUTE_ON_WRITE controls would send an event for the same value
+	if (ctrl->cur.val == val)
+		return 0;
+
+	sensor->ctrl_update = true;
+	ctrl->flags &= ~V4L2_CTRL_FLAG_VOLATILE;
+	ret = __v4l2_ctrl_s_ctrl(ctrl, val);
+	ctrl->flags = flags;
+	sensor->ctrl_update = false;
+	return ret;
+}
+
+// a value read back from the ISP, values the core rejects are kept as read
+static void gs_ctrl_refresh(struct gs_ar0234_dev *sensor, struct v4l2_ctrl *ctrl, s32 val)
+{
+	if (gs_ctrl_update(sensor, ctrl, val))
+		ctrl->cur.val = val;
+}
+
+// head for new targets, a running trajectory carries on from where it is
+static void gs_ptz_start(struct gs_ar0234_dev *sensor, const s32 *from, const s32 *target)
+{
+	struct gs_ptz *ptz = &sensor->ptz;
+	int i;
+
+	for (i = 0; i < GS_PTZ_AXES; i++) {
+		// a new trajectory starts where the last set values left the ISP
+		if (!ptz->active) {
+			ptz->pos[i] = (s64) from[i] << 8;
+			ptz->vel[i] = 0;
+		}
+		ptz->target[i] = target[i];
+	}
+
+	if (!ptz->active) {
+		WRITE_ONCE(ptz->active, true);
+		ptz->last = ktime_get();
+		hrtimer_start(&ptz->timer, gs_ar0234_frame_period(sensor), HRTIMER_MODE_REL);
+	}
+}
+
+// new targets from the zoom cluster, called from s_ctrl
+static int gs_ptz_move(struct gs_ar0234_dev *sensor, struct v4l2_ctrl *master)
+{
+	s32 from[GS_PTZ_AXES], target[GS_PTZ_AXES];
+	int i;
+
+	// nothing moves on a sleeping ISP, it resumes at the targets
+	if (!sensor->powered)
+		return gs_ctrl_cluster_write(sensor, master);
+
+	for (i = 0; i < GS_PTZ_AXES; i++) {
+		from[i] = master->cluster[i]->cur.val;
+		target[i] = master->cluster[i]->val;
+	}
+	gs_ptz_start(sensor, from, target);
+	return 0;
+}
+
+// advance one axis by dt_us, returns true when it reached its target
+static bool gs_ptz_step(struct gs_ar0234_dev *sensor, int axis, s64 dt_us)
+{
+	struct gs_ptz *ptz = &sensor->ptz;
+	s64 target = (s64) ptz->target[axis] << 8;
+	s64 dist = target - ptz->pos[axis];
+	s64 vmax = (s64) gs_ptz_speed(sensor, axis) << 8;
+	s32 ramp = sensor->ctrls.ptz_ramp->cur.val;
+	s64 v, accel, step;
+
+	if (!dist || !vmax) {
+		ptz->pos[axis] = target;
+		ptz->vel[axis] = 0;
+		return true;
+	}
+
+	v = vmax;
+	if (ramp) {
+		// accelerate to vmax within the ramp time, and brake in time for the target
+		accel = div_s64(vmax * MSEC_PER_SEC, ramp);
+		v = min(v, ptz->vel[axis] + div_s64(accel * dt_us, USEC_PER_SEC));
+		v = min(v, (s64) int_sqrt64(2 * accel * abs(dist)));
+	}
+
+	step = max(div_s64(v * dt_us, USEC_PER_SEC), 1LL);
+	if (step >= abs(dist)) {
+		ptz->pos[axis] = target;
+		ptz->vel[axis] = 0;
+		return true;
+	}
+
+	ptz->pos[axis] += dist > 0 ? step : -step;
+	ptz->vel[axis] = v;
+	return false;
+}
+
+static void gs_ptz_work(struct work_struct *work)
+{
+	struct gs_ar0234_dev *sensor = container_of(work, struct gs_ar0234_dev, ptz.work);
+	struct gs_ptz *ptz = &sensor->ptz;
+	struct gs_reg regs[GS_PTZ_AXES];
+	bool done = true;
+	ktime_t now;
+	s64 dt_us;
+	int i, num = 0, ret;
+
+	mutex_lock(&sensor->lock);
+	// the MCU doesn't answer during a command, carry on from here afterwards
+	if (!ptz->active || sensor->cmd)
+		goto out;
+
+	now = ktime_get();
+	dt_us = ktime_us_delta(now, ptz->last);
+	ptz->last = now;
+
+	for (i = 0; i < GS_PTZ_AXES; i++) {
+		done &= gs_ptz_step(sensor, i, dt_us);
+		regs[num] = gs_ptz_regs[i];
+		regs[num].val = ptz->pos[i] >> 8;
+		if (!test_bit(regs[num].addr, sensor->shadow.valid) || sensor->shadow.val[regs[num].addr] != regs[num].val)
+			num++;
+	}
+
+	if (!sensor->powered) {
+		// runtime suspended half way, the resume path takes the ISP to the targets
+		for (i = 0; i < GS_PTZ_AXES; i++)
+			gs_shadow_hold(sensor, gs_ptz_regs[i].addr, gs_ptz_regs[i].size, ptz->target[i]);
+		done = true;
+	} else if (num) {
+		// the engine paces itself, bypass ratelimit_sliders
+		ret = gs_ar0234_write_regs(sensor, regs, num);
+		if (ret)
+			dev_err_ratelimited(sensor->dev, "%s: %d\n", __func__, ret);
+		else
+			gs_shadow_written(sensor, regs, num);
+	}
+
+	if (done) {
+		WRITE_ONCE(ptz->active, false);
+		dev_dbg(sensor->dev, "%s: reached zoom %x pan %x tilt %x\n", __func__,
+			ptz->target[GS_PTZ_ZOOM], ptz->target[GS_PTZ_PAN], ptz->target[GS_PTZ_TILT]);
+	}
+out:
+	mutex_unlock(&sensor->lock);
+}
+
+static enum hrtimer_restart gs_ptz_tick(struct hrtimer *timer)
+{
+	struct gs_ar0234_dev *sensor = container_of(timer, struct gs_ar0234_dev, ptz.timer);
+
+	if (!READ_ONCE(sensor->ptz.active))
+		return HRTIMER_NORESTART;
+
+	schedule_work(&sensor->ptz.work);
+	hrtimer_forward_now(timer, gs_ar0234_frame_period(sensor));
+	return HRTIMER_RESTART;
+}
 
-static inline struct gs_ar0234_dev *to_gs_ar0234_dev(struct v4l2_subdev *sd)
+static void gs_ptz_stop(struct gs_ar0234_dev *sensor)
 {
-	return container_of(sd, struct gs_ar0234_dev, sd);
+	WRITE_ONCE(sensor->ptz.active, false);
+	hrtimer_cancel(&sensor->ptz.timer);
+	cancel_work_sync(&sensor->ptz.work);
 }
 
-static inline struct v4l2_subdev *ctrl_to_sd(struct v4l2_ctrl *ctrl)
+// read all preset slots from NVM in one transfer, the ISP must be powered
+static int gs_ptz_presets_load(struct gs_ar0234_dev *sensor)
 {
-	return &container_of(ctrl->handler, struct gs_ar0234_dev,
-			     ctrls.handler)->sd;
-}
+	u8 buf[GS_PTZ_PRESETS * GS_PTZ_PRESET_SIZE];
+	struct gs_ptz_preset *p;
+	u8 *rec;
+	int i, ret;
 
+	if (sensor->presets_loaded)
+		return 0;
 
-/* --------------- Subdev Operations --------------- */
+	ret = gs_read_nvm(sensor, GS_PTZ_PRESET_PAGE, GS_PTZ_PRESET_ADDR, sizeof(buf), buf);
+	if (ret)
+		return ret;
 
-static int gs_ar0234_s_power(struct v4l2_subdev *sd, int on)
+	for (i = 0; i < GS_PTZ_PRESETS; i++) {
+		p = &sensor->presets[i];
+		rec = buf + i * GS_PTZ_PRESET_SIZE;
+		p->valid = rec[0] == GS_PTZ_PRESET_MAGIC;
+		p->zoom = ((u16) rec[1] << 8) | rec[2];
+		p->pan = rec[3];
+		p->tilt = rec[4];
+		p->zoom_speed = (s8) rec[5];
+	}
+	sensor->presets_loaded = true;
+	return 0;
+}
+
+// read a whole NVM page, in chunks a single NVM command carries
+static int gs_nvm_read_page(struct gs_ar0234_dev *sensor, u8 page, u8 *buf)
 {
-	int ret=0;
-	struct gs_ar0234_dev *sensor = to_gs_ar0234_dev(sd);
-	dev_dbg(sensor->dev, "%s: %s\n", __func__, on ? "up" : "down");
-	mutex_lock(&sensor->lock);
-	ret = gs_ar0234_power(sensor, on);
-	mutex_unlock(&sensor->lock);
-	return ret;
+	int addr, ret;
+
+	for (addr = 0; addr < GS_NVM_PAGE_SIZE; addr += 64) {
+		ret = gs_read_nvm(sensor, page, addr, 64, buf + addr);
+		if (ret)
+			return ret;
+	}
+	return 0;
 }
 
-static int ops_get_fmt(struct v4l2_subdev *sub_dev, struct v4l2_subdev_state *sd_state, struct v4l2_subdev_format *format)
+/*
+ * Write a preset record into the user calibration page together with a new
+ * page CRC, so the firmware doesn't discard the page as corrupt.
+ */
+static int gs_ptz_preset_store(struct gs_ar0234_dev *sensor, int slot)
 {
-	struct gs_ar0234_dev *sensor = to_gs_ar0234_dev(sub_dev);
-	struct v4l2_mbus_framefmt *fmt;
+	struct gs_ar0234_ctrls *ctrls = &sensor->ctrls;
+	struct gs_ptz_preset *p = &sensor->presets[slot];
+	u8 page[GS_NVM_PAGE_SIZE], check[GS_NVM_PAGE_SIZE];
+	u8 addr = GS_PTZ_PRESET_ADDR + slot * GS_PTZ_PRESET_SIZE;
+	u8 *rec = page + addr;
+	u16 crc;
+	int ret;
 
-	dev_dbg(sub_dev->dev, "-> %s: pad: %d\n", __func__, format->pad);
-	if (format->pad >= NUM_PADS)
-		return -EINVAL;
+	// the other slots stay in the mirror
+	ret = gs_ptz_presets_load(sensor);
+	if (ret)
+		return ret;
 
-	if (format->which == V4L2_SUBDEV_FORMAT_TRY)
-		fmt = v4l2_subdev_get_try_format(&sensor->sd, sd_state, format->pad);
-	else
-		fmt = &sensor->fmt;
+	ret = gs_nvm_read_page(sensor, GS_PTZ_PRESET_PAGE, page);
+	if (ret)
+		return ret;
 
-	format->format = *fmt;
-	dev_dbg(sub_dev->dev, "<- %s: %dx%d\n", __func__, fmt->width, fmt->height);
+	rec[0] = GS_PTZ_PRESET_MAGIC;
+	rec[1] = ctrls->zoom->cur.val >> 8;
+	rec[2] = ctrls->zoom->cur.val & 0xFF;
+	rec[3] = ctrls->pan->cur.val;
+	rec[4] = ctrls->tilt->cur.val;
+	rec[5] = (u8) ctrls->zoom_speed->cur.val;
+	rec[6] = 0xFF;
+	rec[7] = 0xFF;
+	crc = gs_crc(0xFFFF, GS_NVM_CRC_ADDR, page);
+	page[GS_NVM_CRC_ADDR] = crc & 0xFF;
+	page[GS_NVM_CRC_ADDR + 1] = crc >> 8;
+
+	ret = gs_ar0234_write_nvm(sensor, GS_PTZ_PRESET_PAGE, addr, GS_PTZ_PRESET_SIZE, rec);
+	if (!ret)
+		ret = gs_ar0234_write_nvm(sensor, GS_PTZ_PRESET_PAGE, GS_NVM_CRC_ADDR, 2, &page[GS_NVM_CRC_ADDR]);
+	if (ret)
+		return ret;
+
+	// the write command reports no programming status, read the page back
+	ret = gs_nvm_read_page(sensor, GS_PTZ_PRESET_PAGE, check);
+	if (ret)
+		return ret;
+	if (memcmp(page, check, sizeof(page))) {
+		dev_err(sensor->dev, "%s: preset %d didn't stick in NVM\n", __func__, slot);
+		return -EIO;
+	}
 
+	p->zoom = ctrls->zoom->cur.val;
+	p->pan = ctrls->pan->cur.val;
+	p->tilt = ctrls->tilt->cur.val;
+	p->zoom_speed = ctrls->zoom_speed->cur.val;
+	p->valid = true;
+	dev_dbg(sensor->dev, "%s: preset %d zoom %x pan %x tilt %x\n", __func__, slot, p->zoom, p->pan, p->tilt);
 	return 0;
 }
 
-static int gs_ar0234_set_fmt(struct v4l2_subdev *sd, struct v4l2_subdev_state *sd_state, struct v4l2_subdev_format *format)
+/*
+ * Apply a preset. All registers go out as one transfer so the view switches
+ * on a single frame, or with a PTZ speed set the engine moves there on one
+ * trajectory. The controls only take over the values afterwards.
+ */
+static int gs_ptz_preset_recall(struct gs_ar0234_dev *sensor, int slot)
 {
-	struct gs_ar0234_dev *sensor = to_gs_ar0234_dev(sd);
-	struct v4l2_mbus_framefmt *fmt = &format->format;
-	int ret=0;
-
-	//dev_info(sensor->dev, "%s %dx%d\n",__func__,format->format.width, format->format.height);
-	dev_info(sensor->dev, "%s %dx%d\n",__func__, fmt->width, fmt->height);
+	struct gs_ar0234_ctrls *ctrls = &sensor->ctrls;
+	struct gs_ptz_preset *p = &sensor->presets[slot];
+	struct gs_reg regs[] = {
+		{ GS_REG_ZOOM, 2, p->zoom },
+		{ GS_REG_ZOOM_SPEED, 1, (u8) p->zoom_speed },
+		{ GS_REG_PAN, 1, p->pan },
+		{ GS_REG_TILT, 1, p->tilt },
+	};
+	int ret;
 
-	if (format->pad >= NUM_PADS)
+	if (!p->valid) {
+		dev_dbg(sensor->dev, "%s: preset %d is empty\n", __func__, slot);
 		return -EINVAL;
+	}
 
-#if 1 //why?
-	if (format->which == V4L2_SUBDEV_FORMAT_TRY)
-		fmt = v4l2_subdev_get_try_format(sd, sd_state, 0);
-	else
-		fmt = &sensor->fmt;
-
-	*fmt = format->format;
-#endif
+	if (gs_ptz_enabled(sensor) && sensor->powered) {
+		// one trajectory to the preset
+		s32 from[GS_PTZ_AXES] = { ctrls->zoom->cur.val, ctrls->pan->cur.val, ctrls->tilt->cur.val };
+		s32 target[GS_PTZ_AXES] = { p->zoom, p->pan, p->tilt };
 
-	sensor->fmt.height = format->format.height;
-	sensor->fmt.width = format->format.width;
+		ret = gs_ctrl_write_batch(sensor, &regs[1], 1);	// zoom speed
+		if (ret)
+			return ret;
+		gs_ptz_start(sensor, from, target);
+	} else {
+		ret = gs_ctrl_write_batch(sensor, regs, ARRAY_SIZE(regs));
+		if (ret)
+			return ret;
+	}
 
-	pr_debug("%s: sensor->ep.bus_type = %d\n", __func__, sensor->ep.bus_type);
-	pr_debug("%s: sensor->ep.bus      = %p\n", __func__, &sensor->ep.bus);
-	pr_debug("%s: sensor->fmt.height  = %d\n", __func__, sensor->fmt.height);
-	pr_debug("%s: sensor->fmt.width   = %d\n", __func__, sensor->fmt.width);
-	pr_debug("%s: sensor->framerate   = %d\n", __func__, sensor->framerate);
-	pr_debug("%s: end \n", __func__);
+	ret = gs_ctrl_update(sensor, ctrls->zoom_speed, p->zoom_speed);
+	if (!ret)
+		ret = gs_ctrl_update(sensor, ctrls->zoom, p->zoom);
+	if (!ret)
+		ret = gs_ctrl_update(sensor, ctrls->pan, p->pan);
+	if (!ret)
+		ret = gs_ctrl_update(sensor, ctrls->tilt, p->tilt);
 	return ret;
 }
 
@@ -155,77 +1299,116 @@ static int gs_ar0234_g_volatile_ctrl(struct v4l2_ctrl *ctrl)
 {
 	struct v4l2_subdev *sd = ctrl_to_sd(ctrl);
 	struct gs_ar0234_dev *sensor = to_gs_ar0234_dev(sd);
-	int ret;
-	u16 shortval;
+	const struct gs_ctrl_desc *desc;
+	struct v4l2_ctrl *c;
+	int i, ret;
 
 	/* v4l2_ctrl_lock() locks our own mutex */
 	dev_dbg_ratelimited(sd->dev, "%s %x: \n", __func__,ctrl->id);
 
-	switch (ctrl->id) {
-		case V4L2_CID_BRIGHTNESS:
-			ret = gs_ar0234_read_reg16(sensor, GS_REG_BRIGHTNESS, &shortval);
-			if (ret < 0)
-				return ret;
-			sensor->ctrls.brightness->val = shortval;
-			break;
+	// AE/AWB only run on a powered ISP, a sleeping or busy one reports the last known values
+	if (!sensor->powered || sensor->cmd)
+		return 0;
 
-		default:
-			ret = -EINVAL;
+	ret = gs_ctrl_snapshot_update(sensor);
+	if (ret < 0)
+		return ret;
+
+	// called for the cluster master, the other members already hold their current value
+	for (i = 0; i < ctrl->ncontrols; i++) {
+		c = ctrl->cluster[i];
+		if (!c || !c->priv)
+			continue;
+		desc = c->priv;
+		if (desc->flags & GS_CTRL_VOLATILE)
+			c->val = gs_ctrl_desc_decode(desc, gs_reg_find(sensor->snapshot.regs, sensor->snapshot.num, desc->reg));
 	}
 
-	return ret;
+	return 0;
 }
 
 static int gs_ar0234_s_ctrl(struct v4l2_ctrl *ctrl)
 {
 	struct v4l2_subdev *sd = ctrl_to_sd(ctrl);
 	struct gs_ar0234_dev *sensor = to_gs_ar0234_dev(sd);
+	const struct gs_ctrl_desc *desc = ctrl->priv;
 	int ret, val;
 	u8 val8;
-	u16 tmp;
+	bool woken = false;
+
+	// status controls, and values that already are in the ISP, see gs_ctrl_update()
+	if ((ctrl->flags & V4L2_CTRL_FLAG_READ_ONLY) || sensor->ctrl_update)
+		return 0;
 
-	dev_dbg_ratelimited(sd->dev, "%s: \n", __func__);
+	// the live values change with whatever is written here
+	sensor->snapshot.valid = false;
+
+	// with a PTZ speed set zoom/pan/tilt are trajectory targets
+	if (ctrl == sensor->ctrls.zoom && gs_ptz_enabled(sensor))
+		return gs_ptz_move(sensor, ctrl);
+
+	// clusters go out as one transfer
+	if (ctrl->ncontrols > 1)
+		return gs_ctrl_cluster_write(sensor, ctrl);
+
+	// plain register controls, the table has the whole data path
+	if (desc && !(desc->flags & GS_CTRL_CUSTOM_WRITE)) {
+		ret = gs_ctrl_desc_write(sensor, desc, ctrl->val);
+		dev_dbg_ratelimited(sd->dev, "%s: set %s to %d\n", __func__, ctrl->name, ctrl->val);
+		return ret;
+	}
 
+	// register writes are deferred while the ISP sleeps, commands are not
 	switch (ctrl->id) {
-	case V4L2_CID_BRIGHTNESS:
-		ret = gs_ar0234_write_reg16(sensor, GS_REG_BRIGHTNESS, ctrl->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set brightness to %d\n", __func__, ctrl->val);
-		break;
-	case V4L2_CID_CONTRAST:
-		ret = gs_ar0234_write_reg16(sensor, GS_REG_CONTRAST, ctrl->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set contrast to %d\n", __func__, ctrl->val);
+	case V4L2_CID_DO_WHITE_BALANCE:
+	case V4L2_CID_STORE_REGISTERS:
+	case V4L2_CID_RESTORE_REGISTERS:
+	case V4L2_CID_RESTORE_FACTORY:
+	case V4L2_CID_REBOOT:
+	case V4L2_CID_PTZ_PRESET_STORE:
+	case V4L2_CID_PTZ_PRESET_RECALL:
+		// one command at a time, the MCU doesn't answer while it runs one
+		if (sensor->cmd)
+			return -EBUSY;
 		break;
-	case V4L2_CID_SATURATION:
-		ret = gs_ar0234_write_reg16(sensor, GS_REG_SATURATION, ctrl->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set saturation to %d\n", __func__, ctrl->val);
+	}
+
+	switch (ctrl->id) {
+	case V4L2_CID_DO_WHITE_BALANCE:
+	case V4L2_CID_PTZ_PRESET_STORE:
+		ret = gs_ctrl_wake(sensor, &woken);
+		if (ret)
+			return ret;
 		break;
-	case V4L2_CID_AUTO_WHITE_BALANCE:
-			ret = gs_ar0234_write_reg8(sensor, GS_REG_WHITEBALANCE, ctrl->val == 0 ? 0x7 : 0xF); // only OFF and ON
-			dev_dbg_ratelimited(sd->dev, "%s: set white balance to %d\n", __func__, ctrl->val);
+	case V4L2_CID_PTZ_PRESET_RECALL:
+		// only the first recall reads the presets from NVM
+		if (!sensor->presets_loaded) {
+			ret = gs_ctrl_wake(sensor, &woken);
+			if (ret)
+				return ret;
+			ret = gs_ptz_presets_load(sensor);
+			if (ret) {
+				gs_ctrl_sleep(sensor, woken);
+				return ret;
+			}
+		}
 		break;
+	}
+
+	switch (ctrl->id) {
 	case V4L2_CID_DO_WHITE_BALANCE:
 			ret = gs_ar0234_write_reg8(sensor, GS_REG_WHITEBALANCE, 0x8); // push to white, when done AWB is in manual mode
+			clear_bit(GS_REG_WHITEBALANCE, sensor->shadow.valid); // the ISP picks the resulting mode, don't replay it
 			dev_dbg_ratelimited(sd->dev, "%s: set push_to_white to %d\n", __func__, ctrl->val);
 		break;
-	case V4L2_CID_WHITE_BALANCE_TEMPERATURE:
-		ret = gs_ar0234_write_reg16(sensor, GS_REG_WB_TEMPERATURE, ctrl->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set white balance temperature to %d K\n", __func__, ctrl->val);
-		break;
 	case V4L2_CID_AUTO_N_PRESET_WHITE_BALANCE:
-		if(ctrl->val == V4L2_WHITE_BALANCE_MANUAL)
-		{
-			if (sensor->ctrls.auto_wb->cur.val == 0) // if WB is disabled
-			{
-				ret = gs_ar0234_write_reg8(sensor, GS_REG_WHITEBALANCE, 0x00); // Control AWB manualy using X, Y parameters
-				dev_dbg_ratelimited(sd->dev, "%s: set white balance temperature to Manual\n", __func__);
-			}
-		}
-		else
+		ret = 0;
+		if (sensor->ctrls.auto_wb->cur.val == 0) // if WB is disabled
 		{
-			if (sensor->ctrls.auto_wb->cur.val == 0) // if WB is disabled
-			{
-				ret = gs_ar0234_write_reg8(sensor, GS_REG_WHITEBALANCE, 0x07); // Control AWB using temperature
-			}
+			// 0: control AWB manualy using X, Y parameters, 7: using temperature
+			ret = gs_ctrl_write8(sensor, GS_REG_WHITEBALANCE, ctrl->val == V4L2_WHITE_BALANCE_MANUAL ? 0x00 : 0x07);
+			if (ret)
+				break;
 		}
 		switch(ctrl->val) {
 			case V4L2_WHITE_BALANCE_MANUAL: 		val = 0; break;
@@ -234,547 +1417,383 @@ static int gs_ar0234_s_ctrl(struct v4l2_ctrl *ctrl)
 			case V4L2_WHITE_BALANCE_FLUORESCENT: 	val = 4000; break;
 			case V4L2_WHITE_BALANCE_FLUORESCENT_H: 	val = 5000; break;
 			case V4L2_WHITE_BALANCE_HORIZON: 		val = 5000; break;
-			case V4L2_WHITE_BALANCE_DAYLIGHT: 		val = 6500; break;
 			case V4L2_WHITE_BALANCE_FLASH: 			val = 5500; break;
 			case V4L2_WHITE_BALANCE_CLOUDY: 		val = 7500; break;
 			case V4L2_WHITE_BALANCE_SHADE: 			val = 9500; break;
+			case V4L2_WHITE_BALANCE_DAYLIGHT:
+			default:					val = 6500; break;
 		}
-		ret = gs_ar0234_write_reg16(sensor, GS_REG_WB_TEMPERATURE, val);
+		ret = gs_ctrl_write16(sensor, GS_REG_WB_TEMPERATURE, val);
 		dev_dbg_ratelimited(sd->dev, "%s: set white balance temperature to %d K\n", __func__, val);
 		break;
-	case V4L2_CID_RED_BALANCE: // Red gain in manual WB
-		break;
-	case V4L2_CID_BLUE_BALANCE: // Blue gain in manual WB
-		break;
-	case V4L2_CID_AWB_MAN_X:
-		ret = gs_ar0234_write_reg16(sensor, GS_REG_AWB_MAN_X, ctrl->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set white balance manual X to %d \n", __func__, ctrl->val);
-		break;
-	case V4L2_CID_AWB_MAN_Y:
-		ret = gs_ar0234_write_reg16(sensor, GS_REG_AWB_MAN_Y, ctrl->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set white balance manual Y to %d \n", __func__, ctrl->val);
-		break;
-	case V4L2_CID_GAMMA:
-		ret = gs_ar0234_write_reg16(sensor, GS_REG_GAMMA, ctrl->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set gamma to %d\n", __func__, ctrl->val);
-		break;
-	case V4L2_CID_EXPOSURE_AUTO: // exposure menu selection
-		switch(ctrl->val) {
-			case V4L2_EXPOSURE_AUTO:
-				val8 = 0xC; // Auto Brightness/Exposure/Gain
-				break;
-			case V4L2_EXPOSURE_MANUAL:
-				val8 = 0x0; // Manual Exposure, manual Gain
-				break;
-			case V4L2_EXPOSURE_SHUTTER_PRIORITY:
-				val8 = 0x9; // Auto BV, Manual Exposure, Auto Gain
-				break;
-			case V4L2_EXPOSURE_APERTURE_PRIORITY:
-				val8 = 0xC; //  For now use same as Auto
-				break;
-			default:
-				val8 = 0xFF; // ignore for others
-				break;
-		}
-		if(val8 < 0xFF) 	{
-			ret = gs_ar0234_write_reg8(sensor, GS_REG_EXPOSURE_MODE, val8);
-			dev_dbg_ratelimited(sd->dev, "%s: set exposure mode to %d\n", __func__, val8);
-		}
-		break;
-	case V4L2_CID_EXPOSURE_ABSOLUTE : // reference level in (us * 100) in order to fit in 16bit:333 = 33300us
-		val = ctrl->val * 100;
-		ret = gs_ar0234_write_reg32(sensor, GS_REG_EXPOSURE_ABS, val);
-		dev_dbg_ratelimited(sd->dev, "%s: set exposure to %d us\n", __func__, val);
-		break;
-	case V4L2_CID_EXPOSURE : // for now use to adjust reference or target level
-		val = ctrl->val;
-		//need to convert val to format s7.8
-		tmp = (u16) (val * 256 / 1000);  // reverse = val * 1000 / 256
-		tmp = val < 0 ? tmp - ((val%1000) > -500 ? 0 : 1) : tmp + ((val%1000) < 500 ? 0 : 1); // rounding
-		ret = gs_ar0234_write_reg16(sensor, GS_REG_AE_TARGET, tmp);
-		dev_dbg_ratelimited(sd->dev, "%s: set autoe exposure target to 0x%04X\n", __func__, tmp);
-		break;
-	case V4L2_CID_EXPOSURE_UPPER:
-		val = ctrl->val * 100;
-		ret = gs_ar0234_write_reg32(sensor, GS_REG_EXPOSURE_UPPER, val);
-		dev_dbg_ratelimited(sd->dev, "%s: set exposure upper to %d us\n", __func__, val);
-		break;
-	case V4L2_CID_EXPOSURE_MAX:
-		val = ctrl->val * 100;
-		ret = gs_ar0234_write_reg32(sensor, GS_REG_EXPOSURE_MAX, val);
-		dev_dbg_ratelimited(sd->dev, "%s: set exposure max to %d us\n", __func__, val);
-		break;
-	case V4L2_CID_GAIN_UPPER:
-		ret = gs_ar0234_write_reg16(sensor, GS_REG_GAIN_UPPER, ctrl->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set gain upper to %d \n", __func__, ctrl->val);
-		break;
-	case V4L2_CID_GAIN_MAX:
-		ret = gs_ar0234_write_reg16(sensor, GS_REG_GAIN_MAX, ctrl->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set gain max to %d \n", __func__, ctrl->val);
-		break;
-	case V4L2_CID_GAIN: // gain level
-		ret = gs_ar0234_write_reg16(sensor, GS_REG_GAIN, ctrl->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set gain to %d\n", __func__, ctrl->val);
-		break;
-	case V4L2_CID_AUTOGAIN: //  ??????<tbd>
-		break;
-	case V4L2_CID_AUTOBRIGHTNESS: //  ?????? <tbd>
-		break;
-	case V4L2_CID_ISO_SENSITIVITY: //  ?????? <tbd>
-		break;
-	case V4L2_CID_ISO_SENSITIVITY_AUTO: //  ?????? <tbd>
-		break;
-
-	case V4L2_CID_EXPOSURE_METERING:
-		switch(ctrl->val) {
-			case V4L2_EXPOSURE_METERING_AVERAGE: 			val8 = 0; break;
-			case V4L2_EXPOSURE_METERING_CENTER_WEIGHTED: 	val8 = 1; break;
-			case V4L2_EXPOSURE_METERING_SPOT: 				val8 = 2; break;
-			case V4L2_EXPOSURE_METERING_MATRIX: 			val8 = 3; break; // apointer to 8 weight table
-		}
-		ret = gs_ar0234_write_reg8(sensor, GS_REG_BLC_MODE, val8);
-		dev_dbg_ratelimited(sd->dev, "%s: set exopure metering to %d\n", __func__, val8);
-		break;
-	case V4L2_CID_BACKLIGHT_COMPENSATION:
-		ret = gs_ar0234_write_reg8(sensor, GS_REG_BLC_LEVEL, ctrl->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set blc level to %d\n", __func__, ctrl->val);
-		break;
-	case V4L2_CID_BLC_WINDOW_X0:
-		ret = gs_ar0234_write_reg8(sensor, GS_REG_BLC_WINDOW_X0, ctrl->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set blc window x0 to %d\n", __func__, ctrl->val);
-		break;
-	case V4L2_CID_BLC_WINDOW_Y0:
-		ret = gs_ar0234_write_reg8(sensor, GS_REG_BLC_WINDOW_Y0, ctrl->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set blc window y0 to %d\n", __func__, ctrl->val);
-		break;
-	case V4L2_CID_BLC_WINDOW_X1:
-		ret = gs_ar0234_write_reg8(sensor, GS_REG_BLC_WINDOW_X1, ctrl->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set blc window x1 to %d\n", __func__, ctrl->val);
-		break;
-	case V4L2_CID_BLC_WINDOW_Y1:
-		ret = gs_ar0234_write_reg8(sensor, GS_REG_BLC_WINDOW_Y1, ctrl->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set blc window y1 to %d\n", __func__, ctrl->val);
-		break;
-	case V4L2_CID_BLC_RATIO:
-		ret = gs_ar0234_write_reg8(sensor, GS_REG_BLC_RATIO, ctrl->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set blc ratio to %d\n", __func__, ctrl->val);
-		break;
-	case V4L2_CID_BLC_FACE_LEVEL:
-		ret = gs_ar0234_write_reg8(sensor, GS_REG_BLC_FACE_LEVEL, ctrl->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set blc face level to %d\n", __func__, ctrl->val);
-		break;
-	case V4L2_CID_BLC_FACE_WEIGHT:
-		ret = gs_ar0234_write_reg8(sensor, GS_REG_BLC_FACE_WEIGHT, ctrl->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set blc face weight to %d\n", __func__, ctrl->val);
-		break;
-	case V4L2_CID_BLC_ROI_LEVEL:
-		ret = gs_ar0234_write_reg8(sensor, GS_REG_BLC_ROI_LEVEL, ctrl->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set blc roi level to %d\n", __func__, ctrl->val);
-		break;
-	case V4L2_CID_FACE_DETECT_0:
-		ret = gs_ar0234_read_reg8(sensor, GS_REG_FACE_DETECT, &val8);
-		if(ret) break;
-		ret = gs_ar0234_write_reg8(sensor, GS_REG_FACE_DETECT, (val8 & (~(1<<0))) | ctrl->val<<0);
-		dev_dbg_ratelimited(sd->dev, "%s: set face detect b0 to %d\n", __func__, ctrl->val);
-		break;
-	case V4L2_CID_FACE_DETECT_4:
-		ret = gs_ar0234_read_reg8(sensor, GS_REG_FACE_DETECT, &val8);
-		if(ret) break;
-		ret = gs_ar0234_write_reg8(sensor, GS_REG_FACE_DETECT, (val8 & (~(1<<4))) | ctrl->val<<4);
-		dev_dbg_ratelimited(sd->dev, "%s: set face detect b4 to %d\n", __func__, ctrl->val);
-		break;
-	case V4L2_CID_FACE_DETECT_5:
-		ret = gs_ar0234_read_reg8(sensor, GS_REG_FACE_DETECT, &val8);
-		if(ret) break;
-		ret = gs_ar0234_write_reg8(sensor, GS_REG_FACE_DETECT, (val8 & (~(1<<5))) | ctrl->val<<5);
-		dev_dbg_ratelimited(sd->dev, "%s: set face detect b5 to %d\n", __func__, ctrl->val);
-		break;
-	case V4L2_CID_FACE_DETECT_SPEED:
-		ret = gs_ar0234_write_reg8(sensor, GS_REG_FACE_DETECT_SPEED, ctrl->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set face detect speed to %d\n", __func__, ctrl->val);
-		break;
-	case V4L2_CID_FACE_DETECT_THRESHOLD:
-		ret = gs_ar0234_write_reg8(sensor, GS_REG_FACE_DETECT_THRESHOLD, ctrl->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set face detect threshold to %d\n", __func__, ctrl->val);
-		break;
-	case V4L2_CID_FACE_CHROMA_THRESHOLD:
-		ret = gs_ar0234_write_reg8(sensor, GS_REG_FACE_CHROMA_THRESHOLD, ctrl->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set face chroma threshold to %d\n", __func__, ctrl->val);
-		break;
-	case V4L2_CID_FACE_MIN_SIZE:
-		ret = gs_ar0234_write_reg16(sensor, GS_REG_FACE_MIN_SIZE, ctrl->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set face min size to %d\n", __func__, ctrl->val);
-		break;
-	case V4L2_CID_FACE_MAX_SIZE:
-		ret = gs_ar0234_write_reg16(sensor, GS_REG_FACE_MAX_SIZE, ctrl->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set face max size to %d\n", __func__, ctrl->val);
-		break;
 	case V4L2_CID_POWER_LINE_FREQUENCY:
-		ret = gs_ar0234_read_reg8(sensor, GS_REG_ANTIFLICKER_MODE, &val8); // set power line frequency
+		ret = gs_ctrl_read8(sensor, GS_REG_ANTIFLICKER_MODE, &val8); // set power line frequency
 		if(ret) break;
 		val8 = val8 & 0xFC; // make bit[1..0] zero
 		switch(ctrl->val) {
 			case V4L2_CID_POWER_LINE_FREQUENCY_DISABLED:
-				ret = gs_ar0234_write_reg8(sensor, GS_REG_ANTIFLICKER_MODE, val8 );
+				ret = gs_ctrl_write8(sensor, GS_REG_ANTIFLICKER_MODE, val8 );
 				break;
 			case V4L2_CID_POWER_LINE_FREQUENCY_50HZ:
-				ret = gs_ar0234_write_reg8(sensor, GS_REG_ANTIFLICKER_MODE, val8 | 1);
+				ret = gs_ctrl_write8(sensor, GS_REG_ANTIFLICKER_MODE, val8 | 1);
 				if(ret) break;
-				ret = gs_ar0234_write_reg8(sensor, GS_REG_ANTIFLICKER_FREQ, 50);
+				ret = gs_ctrl_write8(sensor, GS_REG_ANTIFLICKER_FREQ, 50);
 				break;
 			case V4L2_CID_POWER_LINE_FREQUENCY_60HZ:
-				ret = gs_ar0234_write_reg8(sensor, GS_REG_ANTIFLICKER_MODE, val8 | 1);
+				ret = gs_ctrl_write8(sensor, GS_REG_ANTIFLICKER_MODE, val8 | 1);
 				if(ret) break;
-				ret = gs_ar0234_write_reg8(sensor, GS_REG_ANTIFLICKER_FREQ, 60);
+				ret = gs_ctrl_write8(sensor, GS_REG_ANTIFLICKER_FREQ, 60);
 				break;
 			case V4L2_CID_POWER_LINE_FREQUENCY_AUTO:
 			default:
-				ret = gs_ar0234_write_reg8(sensor, GS_REG_ANTIFLICKER_MODE, val8 | 2);
+				ret = gs_ctrl_write8(sensor, GS_REG_ANTIFLICKER_MODE, val8 | 2);
 				break;
 		}
 		dev_dbg_ratelimited(sd->dev, "%s: set anti flicker  to %d\n", __func__, ctrl->val);
 		break;
-	case V4L2_CID_HFLIP:
-		// mirror is bit[0], flip is bit[1]. Read vflip value and write both
-		ret = gs_ar0234_write_reg8(sensor, GS_REG_MIRROR_FLIP, (sensor->ctrls.vflip->val << 1 | ctrl->val));
-		dev_dbg_ratelimited(sd->dev, "%s: set hflip to %d\n", __func__, ctrl->val);
-		break;
-	case V4L2_CID_VFLIP:
-		// mirror is bit[0], flip is bit[1]. Read hflip value and write both
-		ret = gs_ar0234_write_reg8(sensor, GS_REG_MIRROR_FLIP, ctrl->val << 1 | sensor->ctrls.hflip->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set hflip to %d\n", __func__, ctrl->val);
-		break;
-	case V4L2_CID_SHARPNESS:
-		ret = gs_ar0234_write_reg16(sensor, GS_REG_SHARPNESS, ctrl->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set sharpness to %d\n", __func__, ctrl->val);
+	case V4L2_CID_STORE_REGISTERS:
+	case V4L2_CID_RESTORE_REGISTERS:
+	case V4L2_CID_RESTORE_FACTORY:
+	case V4L2_CID_REBOOT:
+		// these take seconds, cmd_work runs them and reports through cmd_status
+		sensor->cmd = ctrl->id;
+		ret = __v4l2_ctrl_s_ctrl(sensor->ctrls.cmd_status, -EINPROGRESS);
+		schedule_work(&sensor->cmd_work);
+		dev_dbg(sd->dev, "%s: queued %s\n", __func__, ctrl->name);
 		break;
-	case V4L2_CID_COLORFX: // color effect
-		switch (ctrl->val) {
-			case V4L2_COLORFX_NONE: 		val8=0x00; break;
-			case V4L2_COLORFX_BW: 			val8=0x03; break;
-			case V4L2_COLORFX_SEPIA:		val8=0x0D; break;
-			case V4L2_COLORFX_NEGATIVE: 	val8=0x07; break;
-			case V4L2_COLORFX_EMBOSS: 		val8=0x05; break;
-			case V4L2_COLORFX_SKETCH: 		val8=0x0F; break;
-			case V4L2_COLORFX_SKY_BLUE: 	val8=0x08; break;
-			case V4L2_COLORFX_GRASS_GREEN: 	val8=0x09; break;
-			case V4L2_COLORFX_SKIN_WHITEN: 	val8=0x00; break; //?
-			case V4L2_COLORFX_VIVID: 		val8=0x00; break; // ?
-			case V4L2_COLORFX_AQUA: 		val8=0x00; break; // ?
-			case V4L2_COLORFX_ART_FREEZE: 	val8=0x11; break; // foggy
-			case V4L2_COLORFX_SILHOUETTE: 	val8=0x04; break; //emboss B/W
-			case V4L2_COLORFX_SOLARIZATION: val8=0x10; break;
-			case V4L2_COLORFX_ANTIQUE: 		val8=0x02; break;
-			case V4L2_COLORFX_SET_CBCR: 	val8=0x00; break;
-			default: val8 = 0;	break;
+	case V4L2_CID_JPEG_CHROMA_SUBSAMPLING:
+		// part of the output format, takes effect at the next stream start
+		if (sensor->streaming && sensor->fmt.code == MEDIA_BUS_FMT_JPEG_1X8) {
+			ret = -EBUSY;
+			break;
 		}
-		ret = gs_ar0234_write_reg8(sensor, GS_REG_COLORFX, val8);
-		dev_dbg_ratelimited(sd->dev, "%s: set colorfx to %d\n", __func__, val8);
-		break;
-	case V4L2_CID_TEST_PATTERN:
-		ret = gs_ar0234_write_reg8(sensor, GS_REG_TESTPATTERN, ctrl->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set testpattern %d\n", __func__, ctrl->val);
-		break;
-	case V4L2_CID_PAN_ABSOLUTE:
-		ret = gs_ar0234_write_reg8(sensor, GS_REG_PAN, ctrl->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set pan to %d\n", __func__, ctrl->val);
+		gs_ar0234_update_format_type(sensor, ctrl->val);
+		gs_ar0234_prestage(sensor);
+		ret = 0;
+		dev_dbg_ratelimited(sd->dev, "%s: set jpeg chroma subsampling to %d\n", __func__, ctrl->val);
 		break;
-	case V4L2_CID_TILT_ABSOLUTE:
-		ret = gs_ar0234_write_reg8(sensor, GS_REG_TILT, ctrl->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set tilt to %d\n", __func__, ctrl->val);
+	case V4L2_CID_PTZ_ZOOM_SPEED:
+	case V4L2_CID_PTZ_PAN_SPEED:
+	case V4L2_CID_PTZ_TILT_SPEED:
+	case V4L2_CID_PTZ_RAMP:
+		// driver side only, the PTZ engine picks them up on its next step
+		ret = 0;
 		break;
-	case V4L2_CID_ZOOM_ABSOLUTE:
-		ret = gs_ar0234_write_reg16(sensor, GS_REG_ZOOM, ctrl->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set zoom to %d\n", __func__, ctrl->val);
+	case V4L2_CID_PTZ_PRESET:
+		ret = 0;
 		break;
-	case V4L2_CID_ZOOM_SPEED:
-		ret = gs_ar0234_write_reg8(sensor, GS_REG_ZOOM_SPEED, ctrl->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set zoom speed to %d\n", __func__, ctrl->val);
-		break;
-	case V4L2_CID_NOISE_RED:
-		ret = gs_ar0234_write_reg16(sensor, GS_REG_NOISE_RED, ctrl->val);
-		dev_dbg_ratelimited(sd->dev, "%s: set noise reduction to %d\n", __func__, ctrl->val);
-		break;
-	case V4L2_CID_ROI_MODE_0:
-	  	ret = gs_ar0234_read_reg8(sensor, GS_REG_ROI_MODE, &val8); // set power line frequency
-		if(ret) break;
-		ret = gs_ar0234_write_reg8(sensor, GS_REG_ROI_MODE, (val8 & (~(1<<0))) | ctrl->val<<0);
-		dev_dbg_ratelimited(sd->dev, "%s: set roi mode b0 to %d\n", __func__, ctrl->val);
-		break;
-	case V4L2_CID_ROI_MODE_1:
-	  	ret = gs_ar0234_read_reg8(sensor, GS_REG_ROI_MODE, &val8); // set power line frequency
-		if(ret) break;
-		ret = gs_ar0234_write_reg8(sensor, GS_REG_ROI_MODE, (val8 & (~(1<<1))) | ctrl->val<<1);
-		dev_dbg_ratelimited(sd->dev, "%s: set roi mode b1 to %d\n", __func__, ctrl->val);
-		break;
-	case V4L2_CID_ROI_MODE_2:
-	  	ret = gs_ar0234_read_reg8(sensor, GS_REG_ROI_MODE, &val8); // set power line frequency
-		if(ret) break;
-		ret = gs_ar0234_write_reg8(sensor, GS_REG_ROI_MODE, (val8 & (~(1<<2))) | ctrl->val<<2);
-		dev_dbg_ratelimited(sd->dev, "%s: set roi mode b2 to %d\n", __func__, ctrl->val);
-		break;
-	case V4L2_CID_STORE_REGISTERS:
-		ret = gs_ar0234_write_reg8(sensor, GS_REG_SAVE_RESTART, 0x01);
-		if(ret) break;
-		ret = gs_check_wait(sensor, 50, 1000); // wait
-		dev_dbg_ratelimited(sd->dev, "%s: set store registers\n", __func__);
-		break;
-	case V4L2_CID_RESTORE_REGISTERS:
-		ret = gs_ar0234_write_reg8(sensor, GS_REG_SAVE_RESTART, 0x05);
-		if(ret) break;
-		//msleep(2000); //wait 2000 ms for recovery of factory registers
-		ret = gs_check_wait(sensor, 50, 1000); // wait
-		if(ret) break;
-		dev_dbg_ratelimited(sd->dev, "%s: set restore registers\n", __func__);
-		ret = gs_ar0234_i_cntrl(sensor);
-		break;
-	case V4L2_CID_RESTORE_FACTORY:
-		ret = gs_ar0234_write_reg8(sensor, GS_REG_SAVE_RESTART, 0x07);
-		if(ret) break;
-		ret = gs_check_wait(sensor, 50, 1000); // wait
-		if(ret) break;
-		ret = gs_ar0234_write_reg8(sensor, GS_REG_SAVE_RESTART, 0x08);
-		if(ret) break;
-		ret = gs_check_wait(sensor, 50, 1000); // wait
-		if(ret) break;
-		dev_dbg_ratelimited(sd->dev, "%s: set restore factory\n", __func__);
-		ret = gs_ar0234_i_cntrl(sensor);
+	case V4L2_CID_PTZ_PRESET_STORE:
+		ret = gs_ptz_preset_store(sensor, sensor->ctrls.ptz_preset->cur.val);
 		break;
-	case V4L2_CID_REBOOT:
-		ret = gs_ar0234_write_reg8(sensor, GS_REG_SAVE_RESTART, 0x99);
-		dev_dbg_ratelimited(sd->dev, "%s: set reboot\n", __func__);
+	case V4L2_CID_PTZ_PRESET_RECALL:
+		ret = gs_ptz_preset_recall(sensor, sensor->ctrls.ptz_preset->cur.val);
 		break;
 	default:
 		ret = -EINVAL;
 		break;
 	}
 
+	gs_ctrl_sleep(sensor, woken);
 	return ret;
 }
 
 static int gs_ar0234_i_cntrl(struct gs_ar0234_dev *sensor)
 {
-	int ret=0;
-	u32 uval32;
-	u16 uval;
+	struct gs_ar0234_ctrls *ctrls = &sensor->ctrls;
+	struct gs_reg regs[ARRAY_SIZE(gs_ar0234_ctrl_descs) + 2];
+	DECLARE_BITMAP(seen, GS_NUM_REGS);
+	const struct gs_ctrl_desc *desc;
+	struct v4l2_ctrl *ctrl;
+	int num = 0;
+	int ret;
+	s32 powerline;
 	u8 uval8;
-	union  myunion {
-		u16 uval;
-		s16 sval;
-	} val_t;
 
 	dev_dbg(sensor->dev, "%s: \n", __func__);
 
-	ret = gs_ar0234_read_reg16(sensor, GS_REG_BRIGHTNESS, (short *) &sensor->ctrls.brightness->cur.val);
-	if (ret < 0) return ret;
-
-	ret = gs_ar0234_read_reg16(sensor, GS_REG_CONTRAST, (short *)&sensor->ctrls.contrast->cur.val);
-	if (ret < 0) return ret;
-
-	ret = gs_ar0234_read_reg16(sensor, GS_REG_SATURATION, (short *)&sensor->ctrls.saturation->cur.val);
-	if (ret < 0) return ret;
-
-	ret = gs_ar0234_read_reg16(sensor, GS_REG_GAMMA, (short *) &sensor->ctrls.gamma->cur);
-	if (ret < 0) return ret;
-
-	ret = gs_ar0234_read_reg16(sensor, GS_REG_SHARPNESS, (short *)&sensor->ctrls.sharpness->cur.val);
-	if (ret < 0) return ret;
-
-	ret = gs_ar0234_read_reg16(sensor, GS_REG_NOISE_RED, (short *)&sensor->ctrls.noise_red->cur.val);
-	if (ret < 0) return ret;
-
-	ret = gs_ar0234_read_reg16(sensor, GS_REG_SHARPNESS, (short *) &sensor->ctrls.blc_level->cur.val);
-	if (ret < 0) return ret;
-
-	ret = gs_ar0234_read_reg16(sensor, GS_REG_WB_TEMPERATURE, (short *) &sensor->ctrls.wb_temp->cur.val);
-	if (ret < 0) return ret;
-
-	ret = gs_ar0234_read_reg16(sensor, GS_REG_GAIN, (short *) &sensor->ctrls.gain->cur.val);
-	if (ret < 0) return ret;
+	// every register behind a control once, plus the anti flicker pair
+	bitmap_zero(seen, GS_NUM_REGS);
+	for (desc = gs_ar0234_ctrl_descs; desc < gs_ar0234_ctrl_descs + ARRAY_SIZE(gs_ar0234_ctrl_descs); desc++) {
+		if (test_and_set_bit(desc->reg, seen))
+			continue;
+		regs[num++] = (struct gs_reg){ desc->reg, desc->size };
+	}
+	regs[num++] = (struct gs_reg){ GS_REG_ANTIFLICKER_MODE, 1 };
+	regs[num++] = (struct gs_reg){ GS_REG_ANTIFLICKER_FREQ, 1 };
 
-	ret = gs_ar0234_read_reg16(sensor, GS_REG_ZOOM, (short *) &sensor->ctrls.zoom->cur.val);
+	// read all control registers in one batch, then decode
+	ret = gs_ar0234_read_regs(sensor, regs, num);
 	if (ret < 0) return ret;
+	gs_shadow_load(sensor, regs, num);
 
-	ret = gs_ar0234_read_reg8(sensor, GS_REG_ZOOM_SPEED,(u8 *) &sensor->ctrls.zoom_speed->cur.val);
-	if (ret < 0) return ret;
+	for (desc = gs_ar0234_ctrl_descs; desc < gs_ar0234_ctrl_descs + ARRAY_SIZE(gs_ar0234_ctrl_descs); desc++) {
+		ctrl = gs_desc_ctrl(ctrls, desc);
+		// the control already shows a held write
+		if (ctrl && !test_bit(desc->reg, sensor->shadow.pending))
+			gs_ctrl_refresh(sensor, ctrl, gs_ctrl_desc_decode(desc, gs_reg_find(regs, num, desc->reg)));
+	}
 
-	ret = gs_ar0234_read_reg8(sensor, GS_REG_PAN, (u8 *) &sensor->ctrls.pan->cur.val);
-	if (ret < 0) return ret;
+	if (test_bit(GS_REG_ANTIFLICKER_MODE, sensor->shadow.pending) ||
+	    test_bit(GS_REG_ANTIFLICKER_FREQ, sensor->shadow.pending))
+		return 0;
 
-	ret = gs_ar0234_read_reg8(sensor, GS_REG_TILT, (u8 *) &sensor->ctrls.tilt->cur.val);
-	if (ret < 0) return ret;
+	uval8 = gs_reg_find(regs, num, GS_REG_ANTIFLICKER_MODE);
+	if((uval8&0x3) == 0)	powerline = V4L2_CID_POWER_LINE_FREQUENCY_DISABLED;
+	else if((uval8&0x3) == 2)	powerline = V4L2_CID_POWER_LINE_FREQUENCY_AUTO;
+	else {
+		uval8 = gs_reg_find(regs, num, GS_REG_ANTIFLICKER_FREQ);
+		if(uval8 <= 55) powerline = V4L2_CID_POWER_LINE_FREQUENCY_50HZ;
+		else powerline = V4L2_CID_POWER_LINE_FREQUENCY_60HZ;
+	}
+	gs_ctrl_refresh(sensor, ctrls->powerline, powerline);
 
-	ret = gs_ar0234_read_reg8(sensor, GS_REG_TESTPATTERN, (u8 *) &sensor->ctrls.testpattern->cur.val);
-	if (ret < 0) return ret;
+	return 0;
+}
 
-	ret = gs_ar0234_read_reg16(sensor, GS_REG_AE_TARGET, &val_t.uval);
-	if (ret < 0) return ret;
-	sensor->ctrls.exposure->cur.val = (s32) (((s32) val_t.sval) * 1000 / 256);
+/*
+ * Control values are read back lazily: probe (and the firmware handler) only
+ * queue ctrl_sync_work, which reads all control registers in one batch after
+ * the subdev is registered and then powers the ISP down. Anything that needs
+ * the real values before that calls gs_ar0234_sync_ctrls() or flushes the work.
+ * Must be called with sensor->lock held.
+ */
+static int gs_ar0234_sync_ctrls(struct gs_ar0234_dev *sensor)
+{
+	int ret;
 
-	ret = gs_ar0234_read_reg8(sensor, GS_REG_EXPOSURE_MODE, &uval8);
-	if (ret < 0) return ret;
-	switch(uval8) {
-		case 0x0:
-			sensor->ctrls.auto_exp->cur.val = V4L2_EXPOSURE_MANUAL;
-			break;
-		case 0x9:
-			sensor->ctrls.auto_exp->cur.val = V4L2_EXPOSURE_SHUTTER_PRIORITY;
-			break;
-		case 0xC:
-			sensor->ctrls.auto_exp->cur.val = V4L2_EXPOSURE_AUTO;
-			break;
-		default:
-			sensor->ctrls.auto_exp->cur.val = V4L2_EXPOSURE_AUTO;
-			dev_dbg(sensor->dev, "%s: exposure mode = %x is this correct?\n", __func__, uval8);
-			break;
-	}
+	if (sensor->ctrls_synced)
+		return 0;
 
-	ret = gs_ar0234_read_reg32(sensor, GS_REG_EXPOSURE_ABS, &uval32);
-	if (ret < 0) return ret;
-	sensor->ctrls.exposure_absolute->cur.val = uval32/100; // 100us
+	ret = gs_ar0234_i_cntrl(sensor);
+	if (ret)
+		return ret;
 
-	ret = gs_ar0234_read_reg32(sensor, GS_REG_EXPOSURE_UPPER, &uval32);
-	sensor->ctrls.exposure_upper->cur.val = uval32/100; // 100us
-	if (ret < 0) return ret;
+	sensor->ctrls_synced = true;
+	return 0;
+}
 
-	ret = gs_ar0234_read_reg32(sensor, GS_REG_EXPOSURE_MAX, &uval32);
-	sensor->ctrls.exposure_max->cur.val = uval32/100; // 100us
-	if (ret < 0) return ret;
+static void gs_ar0234_ctrl_sync_work(struct work_struct *work)
+{
+	struct gs_ar0234_dev *sensor = container_of(work, struct gs_ar0234_dev, ctrl_sync_work);
+	int ret;
 
-	ret = gs_ar0234_read_reg16(sensor, GS_REG_GAIN_UPPER, (u16 *) &sensor->ctrls.gain_upper->cur.val);
-	if (ret < 0) return ret;
+	// the MCU doesn't answer during a command
+	flush_work(&sensor->cmd_work);
 
-	ret = gs_ar0234_read_reg16(sensor, GS_REG_GAIN_MAX, (u16 *) &sensor->ctrls.gain_max->cur.val);
-	if (ret < 0) return ret;
+	ret = pm_runtime_resume_and_get(sensor->dev);
+	if (ret < 0) {
+		dev_err(sensor->dev, "%s: power up failed: %d\n", __func__, ret);
+		return;
+	}
 
-	ret = gs_ar0234_read_reg8(sensor, GS_REG_ROI_MODE, &uval8);
-	if (ret < 0) return ret;
-	sensor->ctrls.roi_mode_0->cur.val = ((uval8>>0) & 0x01);
-	sensor->ctrls.roi_mode_1->cur.val = ((uval8>>1) & 0x01);
-	sensor->ctrls.roi_mode_2->cur.val = ((uval8>>2) & 0x01);
+	mutex_lock(&sensor->lock);
 
-	ret = gs_ar0234_read_reg8(sensor, GS_REG_BLC_MODE, &uval8);
-	if (ret < 0) return ret;
-	switch(uval8) {
-		case 0x0:
-			sensor->ctrls.exposure_metering->cur.val = V4L2_EXPOSURE_METERING_AVERAGE;
-			break;
-		case 0x1:
-			sensor->ctrls.exposure_metering->cur.val = V4L2_EXPOSURE_METERING_CENTER_WEIGHTED;
-			break;
-		case 0x2:
-			sensor->ctrls.exposure_metering->cur.val = V4L2_EXPOSURE_METERING_SPOT;
-			break;
-		case 0x3:
-			sensor->ctrls.exposure_metering->cur.val = V4L2_EXPOSURE_METERING_MATRIX;
-			break;
-		default:
-			sensor->ctrls.exposure_metering->cur.val = V4L2_EXPOSURE_METERING_CENTER_WEIGHTED;
-			dev_dbg(sensor->dev, "%s: exposure_metering = %x is this correct?\n", __func__, uval8);
-			break;
-	}
+	// read register values from Sensor
+	ret = gs_ar0234_sync_ctrls(sensor);
+	if (ret)
+		dev_err(sensor->dev, "%s: reading control values failed: %d\n", __func__, ret);
 
-	ret = gs_ar0234_read_reg8(sensor, GS_REG_BLC_WINDOW_X0, (u8 *) &sensor->ctrls.blc_window_x0->cur.val);
-	if (ret < 0) return ret;
+	mutex_unlock(&sensor->lock);
 
-	ret = gs_ar0234_read_reg8(sensor, GS_REG_BLC_WINDOW_Y0, (u8 *) &sensor->ctrls.blc_window_y0->cur.val);
-	if (ret < 0) return ret;
+	// powers down once the autosuspend delay expires
+	pm_runtime_mark_last_busy(sensor->dev);
+	pm_runtime_put_autosuspend(sensor->dev);
+}
 
-	ret = gs_ar0234_read_reg8(sensor, GS_REG_BLC_WINDOW_X1, (u8 *) &sensor->ctrls.blc_window_x1->cur.val);
-	if (ret < 0) return ret;
+/*
+ * Store, restore, factory reset and reboot keep the MCU busy for up to
+ * seconds. They run here, without sensor->lock held while the MCU works, so
+ * other control ioctls go on meanwhile: register writes are held in the
+ * shadow and committed afterwards, commands get -EBUSY. cmd_status goes to
+ * -EINPROGRESS when one is queued and to its result when done. Controls a
+ * restore or reboot changed send their own value events before that. Only a
+ * restore drops held writes, the restored values win.
+ */
+// issue the command and wait for the MCU to answer again, sensor->lock not held
+static int gs_ar0234_cmd_run(struct gs_ar0234_dev *sensor, u32 cmd)
+{
+	u8 code;
+	int ret;
 
-	ret = gs_ar0234_read_reg8(sensor, GS_REG_BLC_WINDOW_Y1, (u8 *) &sensor->ctrls.blc_window_y1->cur.val);
-	if (ret < 0) return ret;
+	switch (cmd) {
+	case V4L2_CID_STORE_REGISTERS:		code = 0x01; break;
+	case V4L2_CID_RESTORE_REGISTERS:	code = 0x05; break;
+	case V4L2_CID_RESTORE_FACTORY:		code = 0x07; break;
+	default:				code = 0x99; break;	// reboot
+	}
 
-	ret = gs_ar0234_read_reg8(sensor, GS_REG_BLC_RATIO, (u8 *) &sensor->ctrls.blc_ratio->cur.val);
-	if (ret < 0) return ret;
+	ret = gs_ar0234_write_reg8(sensor, GS_REG_SAVE_RESTART, code);
+	if (ret)
+		return ret;
 
-	ret = gs_ar0234_read_reg8(sensor, GS_REG_BLC_FACE_LEVEL, (u8 *) &sensor->ctrls.blc_face_level->cur.val);
-	if (ret < 0) return ret;
+	// the MCU boots again from NVM, like at power up
+	if (cmd == V4L2_CID_REBOOT) {
+		msleep(100);
+		if (gs_check_wait(sensor, 100, 5000))
+			return -ETIMEDOUT;
+		return 0;
+	}
 
-	ret = gs_ar0234_read_reg8(sensor, GS_REG_BLC_FACE_WEIGHT, (u8 *) &sensor->ctrls.blc_face_weight->cur.val);
-	if (ret < 0) return ret;
+	if (gs_check_wait(sensor, 50, 1000))
+		return -ETIMEDOUT;
 
-	ret = gs_ar0234_read_reg8(sensor, GS_REG_BLC_ROI_LEVEL, (u8 *) &sensor->ctrls.blc_roi_level->cur.val);
-	if (ret < 0) return ret;
+	// factory reset restores the registers, then the calibration parameters
+	if (cmd == V4L2_CID_RESTORE_FACTORY) {
+		ret = gs_ar0234_write_reg8(sensor, GS_REG_SAVE_RESTART, 0x08);
+		if (ret)
+			return ret;
+		if (gs_check_wait(sensor, 50, 1000))
+			return -ETIMEDOUT;
+	}
+	return 0;
+}
 
-	ret = gs_ar0234_read_reg8(sensor, GS_REG_FACE_DETECT, &uval8);
-	if (ret < 0) return ret;
-	sensor->ctrls.face_detect_0->cur.val = ((uval8>>0) & 0x01);
-	sensor->ctrls.face_detect_4->cur.val = ((uval8>>4) & 0x01);
-	sensor->ctrls.face_detect_5->cur.val = ((uval8>>5) & 0x01);
+static void gs_ar0234_cmd_work(struct work_struct *work)
+{
+	struct gs_ar0234_dev *sensor = container_of(work, struct gs_ar0234_dev, cmd_work);
+	u32 cmd;
+	int addr, ret, pm;
 
-	ret = gs_ar0234_read_reg8(sensor, GS_REG_FACE_DETECT_SPEED, (u8 *) &sensor->ctrls.face_detect_speed->cur.val);
-	if (ret < 0) return ret;
+	mutex_lock(&sensor->lock);
+	cmd = sensor->cmd;
+	mutex_unlock(&sensor->lock);
 
-	ret = gs_ar0234_read_reg8(sensor, GS_REG_FACE_DETECT_THRESHOLD, (u8 *) &sensor->ctrls.face_detect_threshold->cur.val);
-	if (ret < 0) return ret;
+	ret = pm = pm_runtime_resume_and_get(sensor->dev);
+	if (!pm)
+		ret = gs_ar0234_cmd_run(sensor, cmd);
 
-	ret = gs_ar0234_read_reg8(sensor, GS_REG_FACE_CHROMA_THRESHOLD, (u8 *) &sensor->ctrls.face_chroma_threshold->cur.val);
-	if (ret < 0) return ret;
+	mutex_lock(&sensor->lock);
+	if (!ret) {
+		switch (cmd) {
+		case V4L2_CID_STORE_REGISTERS:
+			// the stored values are what the firmware starts with from now on, held ones weren't stored
+			for_each_set_bit(addr, sensor->shadow.valid, GS_NUM_REGS) {
+				if (test_bit(addr, sensor->shadow.pending))
+					continue;
+				sensor->shadow.def[addr] = sensor->shadow.val[addr];
+				set_bit(addr, sensor->shadow.has_def);
+			}
+			break;
+		case V4L2_CID_RESTORE_REGISTERS:
+		case V4L2_CID_RESTORE_FACTORY:
+			// the restored values win over writes held meanwhile
+			bitmap_zero(sensor->shadow.pending, GS_NUM_REGS);
+			ret = gs_ar0234_i_cntrl(sensor);
+			break;
+		case V4L2_CID_REBOOT:
+			// registers came back from NVM, forget what was written and read them
+			// again, writes held meanwhile go out on top below
+			bitmap_copy(sensor->shadow.valid, sensor->shadow.pending, GS_NUM_REGS);
+			sensor->ctrls_synced = false;
+			sensor->programmed.valid = false;
+			ret = gs_ar0234_sync_ctrls(sensor);
+			break;
+		}
+	}
+	sensor->cmd = 0;
+	sensor->snapshot.valid = false;
+	if (!pm && gs_shadow_flush(sensor))
+		dev_err(sensor->dev, "%s: writing held controls failed\n", __func__);
+	__v4l2_ctrl_s_ctrl(sensor->ctrls.cmd_status, ret);
+	mutex_unlock(&sensor->lock);
 
-	ret = gs_ar0234_read_reg16(sensor, GS_REG_FACE_MIN_SIZE, (u16 *) &sensor->ctrls.face_min_size->cur.val);
-	if (ret < 0) return ret;
+	if (ret)
+		dev_err(sensor->dev, "%s: command %x failed: %d\n", __func__, cmd, ret);
+	else
+		dev_dbg(sensor->dev, "%s: command %x done\n", __func__, cmd);
 
-	ret = gs_ar0234_read_reg16(sensor, GS_REG_FACE_MAX_SIZE, (u16 *) &sensor->ctrls.face_max_size->cur.val);
-	if (ret < 0) return ret;
+	if (!pm) {
+		pm_runtime_mark_last_busy(sensor->dev);
+		pm_runtime_put_autosuspend(sensor->dev);
+	}
+}
 
-	ret = gs_ar0234_read_reg8(sensor, GS_REG_WHITEBALANCE, &uval8);
-	if (ret < 0) return ret;
-	sensor->ctrls.auto_wb->cur.val = (uval8 & 0x0F) == 0x0F ? 1 : 0;
+static bool gs_ar0234_events_subscribed(struct gs_ar0234_dev *sensor)
+{
+	const struct gs_ctrl_desc *desc;
+	struct v4l2_ctrl *ctrl;
 
-	ret = gs_ar0234_read_reg16(sensor, GS_REG_WB_TEMPERATURE, &uval);
-	if (ret < 0) return ret;
-	if( uval == 0 )  sensor->ctrls.wb_preset->cur.val = V4L2_WHITE_BALANCE_MANUAL;
-	else if(( uval > 2500) && (uval < 3500)) sensor->ctrls.wb_preset->cur.val = V4L2_WHITE_BALANCE_INCANDESCENT;
-	else if(( uval > 3500) && (uval < 4500)) sensor->ctrls.wb_preset->cur.val = V4L2_WHITE_BALANCE_FLUORESCENT;
-	else if(( uval > 4500) && (uval < 5000)) sensor->ctrls.wb_preset->cur.val = V4L2_WHITE_BALANCE_FLUORESCENT_H;
-	else if(( uval > 5000) && (uval < 6000)) sensor->ctrls.wb_preset->cur.val = V4L2_WHITE_BALANCE_HORIZON;
-	else if(( uval > 6000) && (uval < 7000)) sensor->ctrls.wb_preset->cur.val = V4L2_WHITE_BALANCE_DAYLIGHT;
-	//else if(( uval> 5400) && (uval < 5600)) sensor->ctrls.wb_preset->cur.val = V4L2_WHITE_BALANCE_FLASH;
-	else if(( uval > 7000) && (uval < 8000)) sensor->ctrls.wb_preset->cur.val = V4L2_WHITE_BALANCE_CLOUDY;
-	else if(( uval > 8000) && (uval < 10000)) sensor->ctrls.wb_preset->cur.val = V4L2_WHITE_BALANCE_SHADE;
-
-	ret = gs_ar0234_read_reg16(sensor, GS_REG_AWB_MAN_X, (u16 *) &sensor->ctrls.awb_man_x->cur.val);
-	if (ret < 0) return ret;
+	for (desc = gs_ar0234_ctrl_descs; desc < gs_ar0234_ctrl_descs + ARRAY_SIZE(gs_ar0234_ctrl_descs); desc++) {
+		ctrl = gs_desc_ctrl(&sensor->ctrls, desc);
+		if ((desc->flags & GS_CTRL_FW_DRIVEN) && ctrl && !list_empty(&ctrl->ev_subs))
+			return true;
+	}
+	return false;
+}
 
-	ret = gs_ar0234_read_reg16(sensor, GS_REG_AWB_MAN_Y, (u16 *) &sensor->ctrls.awb_man_y->cur.val);
-	if (ret < 0) return ret;
+/*
+ * Read the registers the firmware changes on its own in one batch and set the
+ * controls that moved, which sends their V4L2_EVENT_CTRL. The shadow takes
+ * the values first, so s_ctrl doesn't write them back.
+ * Must be called with sensor->lock held and the ISP powered.
+ */
+static void gs_ar0234_event_sample(struct gs_ar0234_dev *sensor)
+{
+	struct gs_reg_shadow *sh = &sensor->shadow;
+	struct gs_reg regs[8];
+	const struct gs_ctrl_desc *desc;
+	struct v4l2_ctrl *ctrl;
+	int i, num = 0, ret;
+	s32 val;
+
+	for (desc = gs_ar0234_ctrl_descs; desc < gs_ar0234_ctrl_descs + ARRAY_SIZE(gs_ar0234_ctrl_descs); desc++) {
+		if (!(desc->flags & GS_CTRL_FW_DRIVEN) || num == ARRAY_SIZE(regs))
+			continue;
+		for (i = 0; i < num; i++)
+			if (regs[i].addr == desc->reg)
+				break;
+		if (i < num)
+			continue;
+		regs[num].addr = desc->reg;
+		regs[num].size = desc->size;
+		num++;
+	}
 
-	ret = gs_ar0234_read_reg8(sensor, GS_REG_MIRROR_FLIP, &uval8);
-	if (ret < 0) return ret;
-	sensor->ctrls.hflip->cur.val = uval8 & 0x01;
-	sensor->ctrls.vflip->cur.val = (uval8>>1) & 0x01;
+	ret = gs_ar0234_read_regs(sensor, regs, num);
+	if (ret < 0) {
+		dev_dbg_ratelimited(sensor->dev, "%s: %d\n", __func__, ret);
+		return;
+	}
 
-	ret = gs_ar0234_read_reg8(sensor, GS_REG_ANTIFLICKER_MODE, &uval8);
-	if (ret < 0) return ret;
-	if((uval8&0x3) == 0)	sensor->ctrls.powerline->cur.val = V4L2_CID_POWER_LINE_FREQUENCY_DISABLED;
-	else if((uval8&0x3) == 2)	sensor->ctrls.powerline->cur.val = V4L2_CID_POWER_LINE_FREQUENCY_AUTO;
-	else {
-		ret = gs_ar0234_read_reg8(sensor, GS_REG_ANTIFLICKER_FREQ, &uval8);
-		if (ret < 0) return ret;
-		if(uval8 <= 55) sensor->ctrls.powerline->cur.val = V4L2_CID_POWER_LINE_FREQUENCY_50HZ;
-		else if(uval8 >= 55) sensor->ctrls.powerline->cur.val = V4L2_CID_POWER_LINE_FREQUENCY_60HZ;
+	for (desc = gs_ar0234_ctrl_descs; desc < gs_ar0234_ctrl_descs + ARRAY_SIZE(gs_ar0234_ctrl_descs); desc++) {
+		ctrl = gs_desc_ctrl(&sensor->ctrls, desc);
+		// a held write is newer than what the ISP has
+		if (!(desc->flags & GS_CTRL_FW_DRIVEN) || !ctrl || test_bit(desc->reg, sh->pending))
+			continue;
+
+		// the shadow keeps what was written, it is replayed after sleep
+		val = gs_ctrl_desc_decode(desc, gs_reg_find(regs, num, desc->reg));
+		if (val == ctrl->cur.val)
+			continue;
+		dev_dbg(sensor->dev, "%s: firmware set %s to %d\n", __func__, ctrl->name, val);
+		// the ISP already has it, only the cached value and the event
+		ret = gs_ctrl_update(sensor, ctrl, val);
+		if (ret)
+			dev_dbg(sensor->dev, "%s: %s: %d\n", __func__, ctrl->name, ret);
 	}
+}
 
-	ret = gs_ar0234_read_reg8(sensor, GS_REG_COLORFX, &uval8);
-	if (ret < 0) return ret;
-	switch(uval8) {
-		case 0x00:	sensor->ctrls.colorfx->cur.val = V4L2_COLORFX_NONE; break;
-		case 0x03:	sensor->ctrls.colorfx->cur.val = V4L2_COLORFX_BW; break;
-		case 0x0D:	sensor->ctrls.colorfx->cur.val = V4L2_COLORFX_SEPIA; break;
-		case 0x07:	sensor->ctrls.colorfx->cur.val = V4L2_COLORFX_NEGATIVE; break;
-		case 0x05:	sensor->ctrls.colorfx->cur.val = V4L2_COLORFX_EMBOSS; break;
-		case 0x0F:	sensor->ctrls.colorfx->cur.val = V4L2_COLORFX_SKETCH; break;
-		case 0x08:	sensor->ctrls.colorfx->cur.val = V4L2_COLORFX_SKY_BLUE; break;
-		case 0x09:	sensor->ctrls.colorfx->cur.val = V4L2_COLORFX_GRASS_GREEN; break;
-		case 0x11:	sensor->ctrls.colorfx->cur.val = V4L2_COLORFX_ART_FREEZE; break;
-		case 0x04:	sensor->ctrls.colorfx->cur.val = V4L2_COLORFX_SILHOUETTE; break;
-		case 0x10:	sensor->ctrls.colorfx->cur.val = V4L2_COLORFX_SOLARIZATION;	break;
-		case 0x02:	sensor->ctrls.colorfx->cur.val = V4L2_COLORFX_ANTIQUE; break;
-		default: sensor->ctrls.colorfx->cur.val = V4L2_COLORFX_NONE; break;
+/*
+ * Low rate poll for control events, runs while anyone subscribed to one of
+ * the GS_CTRL_FW_DRIVEN controls. A sleeping ISP changes nothing, and a busy
+ * one doesn't answer, so those rounds are skipped.
+ */
+static void gs_ar0234_event_work(struct work_struct *work)
+{
+	struct gs_ar0234_dev *sensor = container_of(to_delayed_work(work), struct gs_ar0234_dev, event_work);
+	int period = event_poll_ms;
+
+	mutex_lock(&sensor->lock);
+	if (period <= 0 || !gs_ar0234_events_subscribed(sensor)) {
+		// the next subscription starts it again
+		mutex_unlock(&sensor->lock);
+		return;
 	}
-	return ret;
+	if (sensor->powered && !sensor->cmd)
+		gs_ar0234_event_sample(sensor);
+	mutex_unlock(&sensor->lock);
+
+	schedule_delayed_work(&sensor->event_work, msecs_to_jiffies(period));
 }
 
 static const struct v4l2_ctrl_ops gs_ar0234_ctrl_ops = {
@@ -799,6 +1818,95 @@ static const struct v4l2_ctrl_config zoom_speed = {
 		.def = -128,
 };
 
+static const struct v4l2_ctrl_config ptz_zoom_speed = {
+	.ops = &gs_ar0234_ctrl_ops,
+	.id = V4L2_CID_PTZ_ZOOM_SPEED,
+	.name = "PTZ zoom speed (1/256x/s)",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.min = 0,
+	.max = 0x2800,
+	.step = 1,
+	.def = 0,
+};
+
+static const struct v4l2_ctrl_config ptz_pan_speed = {
+	.ops = &gs_ar0234_ctrl_ops,
+	.id = V4L2_CID_PTZ_PAN_SPEED,
+	.name = "PTZ pan speed (steps/s)",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.min = 0,
+	.max = 0x400,
+	.step = 1,
+	.def = 0,
+};
+
+static const struct v4l2_ctrl_config ptz_tilt_speed = {
+	.ops = &gs_ar0234_ctrl_ops,
+	.id = V4L2_CID_PTZ_TILT_SPEED,
+	.name = "PTZ tilt speed (steps/s)",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.min = 0,
+	.max = 0x400,
+	.step = 1,
+	.def = 0,
+};
+
+static const struct v4l2_ctrl_config ptz_ramp = {
+	.ops = &gs_ar0234_ctrl_ops,
+	.id = V4L2_CID_PTZ_RAMP,
+	.name = "PTZ ramp time (ms)",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.min = 0,
+	.max = 5000,
+	.step = 1,
+	.def = 0,
+};
+
+static const struct v4l2_ctrl_config zoom_current = {
+	.ops = &gs_ar0234_ctrl_ops,
+	.id = V4L2_CID_ZOOM_CURRENT,
+	.name = "Zoom current",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.flags = V4L2_CTRL_FLAG_READ_ONLY,
+	.min = 0,
+	.max = 0xFFFF,
+	.step = 1,
+	.def = 0x0100,
+};
+
+static const struct v4l2_ctrl_config ptz_preset = {
+	.ops = &gs_ar0234_ctrl_ops,
+	.id = V4L2_CID_PTZ_PRESET,
+	.name = "PTZ preset",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.min = 0,
+	.max = GS_PTZ_PRESETS - 1,
+	.step = 1,
+	.def = 0,
+};
+
+static const struct v4l2_ctrl_config ptz_preset_store = {
+	.ops = &gs_ar0234_ctrl_ops,
+	.id = V4L2_CID_PTZ_PRESET_STORE,
+	.name = "PTZ preset store",
+	.type = V4L2_CTRL_TYPE_BUTTON,
+	.min = 0,
+	.max = 0,
+	.step = 0,
+	.def = 0,
+};
+
+static const struct v4l2_ctrl_config ptz_preset_recall = {
+	.ops = &gs_ar0234_ctrl_ops,
+	.id = V4L2_CID_PTZ_PRESET_RECALL,
+	.name = "PTZ preset recall",
+	.type = V4L2_CTRL_TYPE_BUTTON,
+	.min = 0,
+	.max = 0,
+	.step = 0,
+	.def = 0,
+};
+
 static const struct v4l2_ctrl_config noise_red = {
         .ops = &gs_ar0234_ctrl_ops,
         .id = V4L2_CID_NOISE_RED,
@@ -1138,6 +2246,18 @@ static const struct v4l2_ctrl_config restore_factory = {
 		.def = 0,
 };
 
+static const struct v4l2_ctrl_config cmd_status = {
+	.ops = &gs_ar0234_ctrl_ops,
+	.id = V4L2_CID_CMD_STATUS,
+	.name = "Command status",
+	.type = V4L2_CTRL_TYPE_INTEGER,
+	.flags = V4L2_CTRL_FLAG_READ_ONLY,
+	.min = -4095,
+	.max = 0,
+	.step = 1,
+	.def = 0,
+};
+
 static const struct v4l2_ctrl_config reboot = {
 		.ops = &gs_ar0234_ctrl_ops,
         .id = V4L2_CID_REBOOT,
@@ -1168,6 +2288,7 @@ static int gs_ar0234_init_controls(struct gs_ar0234_dev *sensor)
 	ctrls->restore_registers = v4l2_ctrl_new_custom(hdl, &restore_registers, NULL);
 	ctrls->restore_factory = v4l2_ctrl_new_custom(hdl, &restore_factory, NULL);
 	ctrls->reboot = v4l2_ctrl_new_custom(hdl, &reboot, NULL);
+	ctrls->cmd_status = v4l2_ctrl_new_custom(hdl, &cmd_status, NULL);
 
 	/* Auto/manual white balance */
 	ctrls->auto_wb = v4l2_ctrl_new_std(hdl, ops, V4L2_CID_AUTO_WHITE_BALANCE, 0, 1, 1, 1);
@@ -1229,6 +2350,14 @@ static int gs_ar0234_init_controls(struct gs_ar0234_dev *sensor)
 	ctrls->pan = v4l2_ctrl_new_std(hdl, ops, V4L2_CID_PAN_ABSOLUTE, 0, 0x80, 1, 0x40);
 	ctrls->tilt = v4l2_ctrl_new_std(hdl, ops, V4L2_CID_TILT_ABSOLUTE, 0, 0x80, 1, 0x40);
 	ctrls->zoom_speed = v4l2_ctrl_new_custom(hdl, &zoom_speed, NULL);
+	ctrls->ptz_zoom_speed = v4l2_ctrl_new_custom(hdl, &ptz_zoom_speed, NULL);
+	ctrls->ptz_pan_speed = v4l2_ctrl_new_custom(hdl, &ptz_pan_speed, NULL);
+	ctrls->ptz_tilt_speed = v4l2_ctrl_new_custom(hdl, &ptz_tilt_speed, NULL);
+	ctrls->ptz_ramp = v4l2_ctrl_new_custom(hdl, &ptz_ramp, NULL);
+	ctrls->zoom_current = v4l2_ctrl_new_custom(hdl, &zoom_current, NULL);
+	ctrls->ptz_preset = v4l2_ctrl_new_custom(hdl, &ptz_preset, NULL);
+	ctrls->ptz_preset_store = v4l2_ctrl_new_custom(hdl, &ptz_preset_store, NULL);
+	ctrls->ptz_preset_recall = v4l2_ctrl_new_custom(hdl, &ptz_preset_recall, NULL);
 
 	/* anti flicker */
 	ctrls->powerline = v4l2_ctrl_new_std_menu(hdl, ops, V4L2_CID_POWER_LINE_FREQUENCY, V4L2_CID_POWER_LINE_FREQUENCY_AUTO, 0, V4L2_CID_POWER_LINE_FREQUENCY_AUTO);
@@ -1239,12 +2368,35 @@ static int gs_ar0234_init_controls(struct gs_ar0234_dev *sensor)
 	/* effects */
 	ctrls->colorfx = v4l2_ctrl_new_std_menu(hdl, ops, V4L2_CID_COLORFX, V4L2_COLORFX_SET_CBCR, 0, V4L2_COLORFX_NONE);
 
+	/* jpeg, only 4:2:2 and 4:2:0 */
+	ctrls->jpeg_subsampling = v4l2_ctrl_new_std_menu(hdl, ops, V4L2_CID_JPEG_CHROMA_SUBSAMPLING, V4L2_JPEG_CHROMA_SUBSAMPLING_420,
+		~((1 << V4L2_JPEG_CHROMA_SUBSAMPLING_422) | (1 << V4L2_JPEG_CHROMA_SUBSAMPLING_420)), V4L2_JPEG_CHROMA_SUBSAMPLING_422);
+
+	/* CSI-2 link, read only for the receiver. The ISP runs the first DT link frequency */
+	if (sensor->num_link_freqs) {
+		ctrls->link_freq = v4l2_ctrl_new_int_menu(hdl, NULL, V4L2_CID_LINK_FREQ, sensor->num_link_freqs - 1, 0, sensor->link_freqs);
+		if (ctrls->link_freq)
+			ctrls->link_freq->flags |= V4L2_CTRL_FLAG_READ_ONLY;
+	}
+	ctrls->pixel_rate = v4l2_ctrl_new_std(hdl, NULL, V4L2_CID_PIXEL_RATE, 1, INT_MAX, 1,
+		gs_ar0234_pixel_rate(sensor, gs_ar0234_find_format(sensor->fmt.code)));
+
 	if (hdl->error) {
 		ret = hdl->error;
 		dev_err(sensor->dev, "%s: error: %d\n", __func__, ret);
 		goto free_ctrls;
 	}
 
+	/*
+	 * Controls a host AE/AWB loop sets together, each cluster is committed as
+	 * one transfer. The pointers are adjacent in struct gs_ar0234_ctrls.
+	 */
+	v4l2_ctrl_cluster(4, &ctrls->auto_exp);		// mode, time, gain, target
+	v4l2_ctrl_cluster(4, &ctrls->auto_wb);		// mode, temperature, manual x/y
+	v4l2_ctrl_cluster(2, &ctrls->hflip);
+	v4l2_ctrl_cluster(3, &ctrls->zoom);		// zoom, pan, tilt
+
+	gs_ar0234_bind_ctrl_descs(sensor);
 	sensor->sd.ctrl_handler = hdl;
 	return 0;
 
@@ -1253,219 +2405,572 @@ free_ctrls:
 	return ret;
 }
 
-static int gs_ar0234_code_supported(u32 code)
-{
-	switch(code){
-		case MEDIA_BUS_FMT_YUYV8_1X16: //2011
-		case MEDIA_BUS_FMT_UYVY8_1X16: //200f
-		// case MEDIA_BUS_FMT_YUV8_1X24: //2025
-		case MEDIA_BUS_FMT_RGB888_1X24: //100a
-		case MEDIA_BUS_FMT_RGB565_1X16: //1017
-		case MEDIA_BUS_FMT_RGB555_2X8_PADHI_LE: //1004
-		case MEDIA_BUS_FMT_JPEG_1X8: // 14001
-		case MEDIA_BUS_FMT_SRGGB16_1X16: //3020
-		case MEDIA_BUS_FMT_SRGGB12_1X12: //3012
-		case MEDIA_BUS_FMT_SRGGB10_1X10: //300f
-		case MEDIA_BUS_FMT_SRGGB8_1X8: //3014
-			return 1;
-		default:
+static int ops_enum_frame_size(struct v4l2_subdev *sub_dev, struct v4l2_subdev_state *sd_state, struct v4l2_subdev_frame_size_enum *fse)
+{
+	dev_dbg(sub_dev->dev, "%s (fmt.code: 0x%04x)\n", __func__, fse->code);
+
+	if (fse->pad >= NUM_PADS)
+		return -EINVAL;
+
+	if (!gs_ar0234_find_format(fse->code))
+		return -EINVAL;
+
+	if (fse->index >= ARRAY_SIZE(gs_ar0234_modes))
+		return -EINVAL;
+
+	fse->min_width  = gs_ar0234_modes[fse->index].width;
+	fse->max_width  = gs_ar0234_modes[fse->index].width;
+	fse->min_height = gs_ar0234_modes[fse->index].height;
+	fse->max_height = gs_ar0234_modes[fse->index].height;
+	dev_dbg_ratelimited(sub_dev->dev, "%s: offer %s\n", __func__, gs_ar0234_modes[fse->index].name);
+	return 0;
+}
+
+// the maximum rate of the mode/format first, then the common rates below it
+static int ops_enum_frame_interval(struct v4l2_subdev *sub_dev, struct v4l2_subdev_state *sd_state, struct v4l2_subdev_frame_interval_enum *fie)
+{
+	const struct gs_ar0234_format *format;
+	const struct resolution *mode;
+	u32 max_fps;
+	int i, index = 0;
+
+	if (fie->pad >= NUM_PADS)
+		return -EINVAL;
+
+	format = gs_ar0234_find_format(fie->code);
+	mode = gs_ar0234_find_mode(fie->width, fie->height);
+	if (!format || !mode)
+		return -EINVAL;
+
+	max_fps = gs_ar0234_max_fps(to_gs_ar0234_dev(sub_dev), mode, format);
+
+	if (fie->index == 0) {
+		gs_fps_to_interval(max_fps, &fie->interval);
+		return 0;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(gs_ar0234_intervals); i++) {
+		if (gs_interval_to_fps(&gs_ar0234_intervals[i]) >= max_fps)
+			continue;
+		if (++index == fie->index) {
+			fie->interval = gs_ar0234_intervals[i];
+			dev_dbg_ratelimited(sub_dev->dev, "%s: %d %d/%d \n", __func__, fie->index, fie->interval.numerator, fie->interval.denominator);
+			return 0;
+		}
+	}
+	return -EINVAL;
+}
+
+static int ops_get_frame_interval(struct v4l2_subdev *sub_dev, struct v4l2_subdev_frame_interval *fi)
+{
+	struct gs_ar0234_dev *sensor = to_gs_ar0234_dev(sub_dev);
+
+	dev_dbg(sub_dev->dev, "%s 0x%04x: \n", __func__, sensor->framerate);
+
+	if (fi->pad >= NUM_PADS)
+		return -EINVAL;
+
+	// exact interval of the register value, not what was asked for
+	gs_fps_to_interval(sensor->framerate, &fi->interval);
+
+	return 0;
+}
+
+static int ops_set_frame_interval(struct v4l2_subdev *sub_dev, struct v4l2_subdev_frame_interval *fi)
+{
+	struct gs_ar0234_dev *sensor = to_gs_ar0234_dev(sub_dev);
+	u32 fps, max_fps;
+
+	dev_dbg(sub_dev->dev, "%s(setting interval = %d/%d)\n", __func__, fi->interval.numerator, fi->interval.denominator);
+
+	if (fi->pad >= NUM_PADS)
+		return -EINVAL;
+
+	mutex_lock(&sensor->lock);
+
+	// round to the register's 1/256 fps resolution, clamp to what the current mode and format support
+	max_fps = gs_ar0234_max_fps(sensor, sensor->mode, gs_ar0234_find_format(sensor->fmt.code));
+	if (fi->interval.numerator == 0 || fi->interval.denominator == 0)
+		fps = max_fps;
+	else
+		fps = clamp_t(u32, gs_interval_to_fps(&fi->interval), GS_FPS(1), max_fps);
+
+	// FRAMERATE is only programmed at stream start
+	if (sensor->streaming && fps != sensor->framerate) {
+		mutex_unlock(&sensor->lock);
+		return -EBUSY;
+	}
+
+	sensor->framerate = fps;
+	gs_fps_to_interval(fps, &fi->interval);
+	if (!sensor->num_link_freqs)
+		__v4l2_ctrl_s_ctrl_int64(sensor->ctrls.pixel_rate, gs_ar0234_pixel_rate(sensor, gs_ar0234_find_format(sensor->fmt.code)));
+
+	mutex_unlock(&sensor->lock);
+
+	gs_ar0234_prestage(sensor);
+	return 0;
+}
+
+
+
+static int gs_ar0234_enum_mbus_code(struct v4l2_subdev *sub_dev, struct v4l2_subdev_state *sd_state, struct v4l2_subdev_mbus_code_enum *code)
+{
+	dev_dbg(sub_dev->dev, "%s: code->index = %d\n", __func__, code->index);
+
+	if ((code->pad >= NUM_PADS))
+		return -EINVAL;
+
+	if (code->index >= ARRAY_SIZE(gs_ar0234_formats))
+		return -EINVAL;
+
+	code->code = gs_ar0234_formats[code->index].code;
+	return 0;
+}
+
+/*
+ * Program the output format and, with enable set, turn on the MIPI output. Only
+ * the fields that differ from what the ISP was last programmed with are
+ * written, inside a single FORMAT_CHANGE/FORMAT_DONE bracket, and after each
+ * one the ISP is polled until it accepts commands again instead of waiting a
+ * fixed time. Without enable the ISP is left in FORMAT_CHANGE (standby),
+ * so a later call only has to write FORMAT_DONE.
+ * Returns the number of fields written. sensor->lock held.
+ */
+static int gs_ar0234_program_format(struct gs_ar0234_dev *sensor, bool enable)
+{
+	struct gs_stream_cfg *prog = &sensor->programmed;
+	struct gs_stream_cfg cfg = {
+		.valid = true,
+		.format_type = sensor->format_type,
+		.width = sensor->mode->width,
+		.height = sensor->mode->height,
+		// set fr reg- 0x16 (16b = 8b,8b [fraction)]), e.g. 29.97 = 0x1DF8
+		.framerate = sensor->framerate,
+	};
+	struct gs_reg regs[4];
+	// after s_stream(0) or a prestage the ISP already sits in FORMAT_CHANGE with MIPI off
+	bool standby = prog->valid && sensor->standby;
+	int i, num = 0, ret;
+
+	if (!prog->valid || prog->format_type != cfg.format_type)
+		regs[num++] = (struct gs_reg){ GS_REG_FORMAT_TYPE, 1, cfg.format_type };
+	if (!prog->valid || prog->width != cfg.width)
+		regs[num++] = (struct gs_reg){ GS_REG_FORMAT_X, 2, cfg.width };
+	if (!prog->valid || prog->height != cfg.height)
+		regs[num++] = (struct gs_reg){ GS_REG_FORMAT_Y, 2, cfg.height };
+	if (!prog->valid || prog->framerate != cfg.framerate)
+		regs[num++] = (struct gs_reg){ GS_REG_FRAMERATE, 2, cfg.framerate };
+
+	if (num == 0) {
+		if (!enable)
 			return 0;
+		//turn on mipi, the ISP still has the right format
+		ret = gs_ar0234_write_reg8(sensor, GS_REG_SET_STATE, FORMAT_DONE);
+		if (!ret)
+			sensor->standby = false;
+		return ret;
+	}
+
+	prog->valid = false;
+
+	// turn off mipi lanes
+	if (!standby) {
+		ret = gs_ar0234_write_reg8(sensor, GS_REG_SET_STATE, FORMAT_CHANGE); // format change state
+		if (ret)
+			return ret;
+		sensor->standby = true;
+	}
+
+	// the MCU goes busy after every format field, a batch would be NAKed
+	// from its second message on, so write them one at a time
+	for (i = 0; i < num; i++) {
+		ret = gs_ar0234_write_regs(sensor, &regs[i], 1);
+		if (ret)
+			return ret;
+		// wait until the field is applied
+		if (gs_check_wait(sensor, 1, 150))
+			return -ETIMEDOUT;
+	}
+
+	*prog = cfg;
+	if (!enable)
+		return num;
+
+	//turn on mipi
+	ret = gs_ar0234_write_reg8(sensor, GS_REG_SET_STATE, FORMAT_DONE); // format change state Done
+	if (ret)
+		return ret;
+	sensor->standby = false;
+
+	return num;
+}
+
+/*
+ * With prestage_format set, an ACTIVE set_fmt/s_frame_interval while not
+ * streaming programs the new format in the background and leaves the ISP in
+ * standby, which takes the format change off the first frame's critical path.
+ * s_stream(1) then only writes FORMAT_DONE, as long as the ISP wasn't powered
+ * down (autosuspend) in between.
+ */
+static void gs_ar0234_prestage_work(struct work_struct *work)
+{
+	struct gs_ar0234_dev *sensor = container_of(work, struct gs_ar0234_dev, prestage_work);
+	int ret;
+
+	flush_work(&sensor->cmd_work);
+
+	ret = pm_runtime_resume_and_get(sensor->dev);
+	if (ret < 0) {
+		dev_err(sensor->dev, "%s: power up failed: %d\n", __func__, ret);
+		return;
+	}
+
+	mutex_lock(&sensor->lock);
+	if (!sensor->streaming) {
+		ret = gs_ar0234_program_format(sensor, false);
+		if (ret < 0)
+			dev_err(sensor->dev, "%s: format programming failed: %d\n", __func__, ret);
+		else
+			dev_dbg(sensor->dev, "%s: %d fields staged\n", __func__, ret);
+	}
+	mutex_unlock(&sensor->lock);
+
+	pm_runtime_mark_last_busy(sensor->dev);
+	pm_runtime_put_autosuspend(sensor->dev);
+}
+
+static void gs_ar0234_prestage(struct gs_ar0234_dev *sensor)
+{
+	if (prestage_format && !sensor->streaming)
+		schedule_work(&sensor->prestage_work);
+}
+
+// throttled slider values, anything held while asleep goes out on resume instead
+static void gs_ar0234_ratelimit_work(struct work_struct *work)
+{
+	struct gs_ar0234_dev *sensor = container_of(work, struct gs_ar0234_dev, ratelimit_work);
+	int ret;
+
+	mutex_lock(&sensor->lock);
+	if (sensor->powered && !sensor->cmd) {
+		ret = gs_shadow_flush(sensor);
+		if (ret)
+			dev_err_ratelimited(sensor->dev, "%s: %d\n", __func__, ret);
 	}
+	mutex_unlock(&sensor->lock);
+}
+
+static enum hrtimer_restart gs_ar0234_ratelimit_tick(struct hrtimer *timer)
+{
+	struct gs_ar0234_dev *sensor = container_of(timer, struct gs_ar0234_dev, ratelimit_timer);
+
+	schedule_work(&sensor->ratelimit_work);
+	return HRTIMER_NORESTART;
 }
 
-static int ops_enum_frame_size(struct v4l2_subdev *sub_dev, struct v4l2_subdev_state *sd_state, struct v4l2_subdev_frame_size_enum *fse)
-{
-	dev_dbg(sub_dev->dev, "%s (fmt.code: 0x%04x)\n", __func__, fse->code);
+static int gs_ar0234_s_stream(struct v4l2_subdev *sd, int enable)
+{
+	struct gs_ar0234_dev *sensor = to_gs_ar0234_dev(sd);
+	int ret = 0;
+	ktime_t start;
+	bool cold;
+	u32 latency;
+	int changed;
+
+	pr_debug("%s: start: csi%d, format: %d\n", __func__, sensor->csi_id, sensor->format_type);
+
+	if (sensor->ep.bus_type != V4L2_MBUS_CSI2_DPHY){
+		dev_err(sensor->dev, "endpoint bus_type not supported: %d\n", sensor->ep.bus_type);
+		return -EINVAL;
+	}
+
+	if (enable)
+	{
+		if (sensor->streaming)
+			return 0;
+
+		// power up outside sensor->lock, runtime resume takes it
+		start = ktime_get();
+		flush_work(&sensor->prestage_work);
+		flush_work(&sensor->cmd_work);
+		cold = !pm_runtime_active(sensor->dev);
+		ret = pm_runtime_resume_and_get(sensor->dev);
+		if (ret < 0)
+			return ret;
+
+		mutex_lock(&sensor->lock);
 
-	if (fse->pad >= NUM_PADS)
-		return -EINVAL;
+		ret = gs_ar0234_program_format(sensor, true);
+		if (ret < 0) {
+			mutex_unlock(&sensor->lock);
+			dev_err(sensor->dev, "%s: stream start failed: %d\n", __func__, ret);
+			pm_runtime_mark_last_busy(sensor->dev);
+			pm_runtime_put_autosuspend(sensor->dev);
+			return ret;
+		}
+		changed = ret;
+		ret = 0;
 
-	if( gs_ar0234_code_supported(fse->code) == 0)
-		return -EINVAL;
+		sensor->streaming = true;
+		latency = ktime_us_delta(ktime_get(), start);
+		if (cold)
+			sensor->stream_start_cold_us = latency;
+		else
+			sensor->stream_start_warm_us = latency;
+		if (changed)
+			sensor->stream_start_changed_us = latency;
+		else
+			sensor->stream_start_unchanged_us = latency;
 
-	if (fse->index == 0) {
-		fse->min_width  = 64;
-		fse->min_height	= 64;
-		fse->max_width  = 1920;
-		fse->max_height = 1200;
-		dev_dbg_ratelimited(sub_dev->dev, "%s: offer size variable\n", __func__);
-		//dev_dbg(sub_dev->dev, "%s: offer size variable\n", __func__);
-		return 0;
-	}
+		mutex_unlock(&sensor->lock);
 
-	return -EINVAL;
-}
+		pr_debug("%s: Starting stream at WxH@fps=%dx%d@%d.%02d\n", __func__, sensor->fmt.width, sensor->fmt.height, sensor->framerate >> 8, (sensor->framerate & 0xff) * 100 / 256);
+		dev_dbg(sensor->dev, "%s: %s start, %d fields changed, took %u us\n", __func__, cold ? "cold" : "warm", changed, latency);
+	}
+	else
+	{
+		pr_debug("%s: Stopping stream \n", __func__);
 
-#if 0 //don't use
-static int ops_enum_frame_interval(struct v4l2_subdev *sub_dev, struct v4l2_subdev_state *sd_state, struct v4l2_subdev_frame_interval_enum *fie)
-{
-	if (fie->pad >= NUM_PADS)
-		return -EINVAL;
+		if (!sensor->streaming)
+			return 0;
 
-	if( gs_ar0234_code_supported(fie->code) == 0)
-		return -EINVAL;
+		mutex_lock(&sensor->lock);
+		sensor->streaming = false;
+		// stop MIPI and keep the programmed format, a restart with it is a single FORMAT_DONE
+		ret = gs_ar0234_write_reg8(sensor, GS_REG_SET_STATE, FORMAT_CHANGE);
+		if (ret) {
+			dev_warn(sensor->dev, "%s: standby failed: %d\n", __func__, ret);
+			sensor->programmed.valid = false;
+			ret = 0;
+		} else {
+			sensor->standby = true;
+		}
+		mutex_unlock(&sensor->lock);
 
-	fie->interval.numerator = 1;
-	if (fie->index <= 61) {
-		fie->interval.denominator = fie->index;
-		dev_dbg_ratelimited(sub_dev->dev, "%s: %d %d \n", __func__, fie->index, fie->interval.denominator);
-		//dev_dbg(sub_dev->dev, "%s: %d %d \n", __func__, fie->index, fie->interval.denominator);
-		return 0;
+		// stay powered for autosuspend_delay_ms in case the next stream follows shortly
+		pm_runtime_mark_last_busy(sensor->dev);
+		pm_runtime_put_autosuspend(sensor->dev);
 	}
-	return -EINVAL;
+
+	return ret;
 }
-#endif
 
 
-static int ops_get_frame_interval(struct v4l2_subdev *sub_dev, struct v4l2_subdev_frame_interval *fi)
-{
-	struct gs_ar0234_dev *sensor = to_gs_ar0234_dev(sub_dev);
+/*
+ * JPEG frames vary in size, so the receiver has to size its buffers for the
+ * worst case: the uncompressed 4:2:2 or 4:2:0 frame plus room for the headers.
+ */
+#define GS_JPEG_HEADER_MAX	4096
 
-	dev_dbg(sub_dev->dev, "%s %d: \n", __func__, sensor->framerate);
+static int gs_ar0234_get_frame_desc(struct v4l2_subdev *sd, unsigned int pad, struct v4l2_mbus_frame_desc *fd)
+{
+	struct gs_ar0234_dev *sensor = to_gs_ar0234_dev(sd);
+	const struct gs_ar0234_format *format;
+	u32 pixels;
 
-	if (fi->pad >= NUM_PADS)
+	if (pad >= NUM_PADS)
 		return -EINVAL;
 
-	fi->interval.numerator = 1;
-	fi->interval.denominator = sensor->framerate;
+	memset(fd, 0, sizeof(*fd));
+	fd->type = V4L2_MBUS_FRAME_DESC_TYPE_CSI2;
+	fd->num_entries = 1;
+
+	mutex_lock(&sensor->lock);
+	format = gs_ar0234_find_format(sensor->fmt.code);
+	fd->entry[0].pixelcode = sensor->fmt.code;
+	// a single stream on virtual channel 0
+	fd->entry[0].bus.csi2.vc = 0;
+	fd->entry[0].bus.csi2.dt = format ? format->csi2_dt : 0;
+	if (sensor->fmt.code == MEDIA_BUS_FMT_JPEG_1X8) {
+		pixels = sensor->fmt.width * sensor->fmt.height;
+		fd->entry[0].flags = V4L2_MBUS_FRAME_DESC_FL_LEN_MAX | V4L2_MBUS_FRAME_DESC_FL_BLOB;
+		if (sensor->format_type == GS_CF_JPEG420)
+			fd->entry[0].length = pixels * 3 / 2 + GS_JPEG_HEADER_MAX;
+		else
+			fd->entry[0].length = pixels * 2 + GS_JPEG_HEADER_MAX;
+	}
+	mutex_unlock(&sensor->lock);
 
 	return 0;
 }
 
-static int ops_set_frame_interval(struct v4l2_subdev *sub_dev, struct v4l2_subdev_frame_interval *fi)
+/*
+ * Selection API on top of the digital zoom. At 1x the ISP scales the largest
+ * centred window of the pixel array that has the output aspect ratio; the
+ * zoom (8.8, 0x100 = 1x) shrinks that window and pan/tilt (0..0x80, 0x40 =
+ * centre) move it inside the 1x field of view.
+ */
+#define GS_NATIVE_WIDTH		1920
+#define GS_NATIVE_HEIGHT	1200
+#define GS_ZOOM_1X		0x100
+#define GS_ZOOM_MAX		0x2800
+#define GS_PAN_MAX		0x80
+
+// 1x field of view for an output size
+static void gs_ar0234_fov(u32 width, u32 height, struct v4l2_rect *fov)
 {
-	struct gs_ar0234_dev *sensor = to_gs_ar0234_dev(sub_dev);
+	fov->width = min_t(u32, GS_NATIVE_WIDTH, GS_NATIVE_HEIGHT * width / height);
+	fov->height = min_t(u32, GS_NATIVE_HEIGHT, GS_NATIVE_WIDTH * height / width);
+	fov->left = (GS_NATIVE_WIDTH - fov->width) / 2;
+	fov->top = (GS_NATIVE_HEIGHT - fov->height) / 2;
+}
 
-	dev_dbg(sub_dev->dev, "%s(setting interval = %d)\n", __func__, fi->interval.denominator);
+static void gs_ar0234_zoom_to_crop(const struct v4l2_mbus_framefmt *fmt, u32 zoom, u32 pan, u32 tilt, struct v4l2_rect *crop)
+{
+	struct v4l2_rect fov;
+
+	gs_ar0234_fov(fmt->width, fmt->height, &fov);
+	zoom = clamp_t(u32, zoom, GS_ZOOM_1X, GS_ZOOM_MAX);
+	crop->width = fov.width * GS_ZOOM_1X / zoom;
+	crop->height = fov.height * GS_ZOOM_1X / zoom;
+	crop->left = fov.left + (fov.width - crop->width) * min_t(u32, pan, GS_PAN_MAX) / GS_PAN_MAX;
+	crop->top = fov.top + (fov.height - crop->height) * min_t(u32, tilt, GS_PAN_MAX) / GS_PAN_MAX;
+}
 
-	if(fi->interval.denominator <= 121) {
-		sensor->framerate = fi->interval.denominator;
-		return 0;
+// zoom so the window covers the requested rectangle, pan/tilt to centre it where it was asked for
+static void gs_ar0234_crop_to_zoom(const struct v4l2_mbus_framefmt *fmt, const struct v4l2_rect *crop, u32 *zoom, u32 *pan, u32 *tilt)
+{
+	struct v4l2_rect fov;
+	u32 width, height;
+	s32 pos;
+
+	gs_ar0234_fov(fmt->width, fmt->height, &fov);
+	width = clamp_t(u32, crop->width, 1, fov.width);
+	height = clamp_t(u32, crop->height, 1, fov.height);
+	*zoom = clamp_t(u32, min(fov.width * GS_ZOOM_1X / width, fov.height * GS_ZOOM_1X / height), GS_ZOOM_1X, GS_ZOOM_MAX);
+
+	width = fov.width * GS_ZOOM_1X / *zoom;
+	height = fov.height * GS_ZOOM_1X / *zoom;
+	*pan = GS_PAN_MAX / 2;
+	*tilt = GS_PAN_MAX / 2;
+	if (fov.width > width) {
+		pos = crop->left + (s32)crop->width / 2 - (s32)width / 2 - fov.left;
+		*pan = clamp_t(s32, pos * GS_PAN_MAX / (s32)(fov.width - width), 0, GS_PAN_MAX);
+	}
+	if (fov.height > height) {
+		pos = crop->top + (s32)crop->height / 2 - (s32)height / 2 - fov.top;
+		*tilt = clamp_t(s32, pos * GS_PAN_MAX / (s32)(fov.height - height), 0, GS_PAN_MAX);
 	}
-	dev_err(sensor->dev, "unsupported framerate: %d\n", fi->interval.denominator);
-	return -EINVAL;
 }
 
-
-
-static int gs_ar0234_enum_mbus_code(struct v4l2_subdev *sub_dev, struct v4l2_subdev_state *sd_state, struct v4l2_subdev_mbus_code_enum *code)
+static int gs_ar0234_get_selection(struct v4l2_subdev *sd, struct v4l2_subdev_state *sd_state, struct v4l2_subdev_selection *sel)
 {
-	int ret = 0;
-	struct gs_ar0234_dev *sensor = to_gs_ar0234_dev(sub_dev);
-
-	//dev_dbg_ratelimited(sub_dev->dev, "%s: code->code = 0x%08x\n", __func__, code->code);
-	dev_dbg(sub_dev->dev, "%s: code->code = 0x%08x\n", __func__, code->code);
+	struct gs_ar0234_dev *sensor = to_gs_ar0234_dev(sd);
 
-	if ((code->pad >= NUM_PADS))
+	if (sel->pad >= NUM_PADS)
 		return -EINVAL;
 
-	switch (code->index) {
-		case 	GS_CF_YUV422:
-		case 	GS_CF_YUV420:
-		case 	GS_CF_YUV400:
-		case 	GS_CF_YUV422BT:
-		case 	GS_CF_YUV420BT:
-		case 	GS_CF_YUV400BT:
-			code->code = MEDIA_BUS_FMT_YUYV8_1X16; //MEDIA_BUS_FMT_YUYV8_1X16
-			//code->code = MEDIA_BUS_FMT_UYVY8_1X16; //MEDIA_BUS_FMT_UYVY8_1X16
-			break;
-		case 	GS_CF_RGB_888:
-			code->code = MEDIA_BUS_FMT_RGB888_1X24;
-			break;
-		case 	GS_CF_RGB_565:
-			code->code = MEDIA_BUS_FMT_RGB565_1X16;
-			break;
-		case 	GS_CF_RGB_555:
-			code->code = MEDIA_BUS_FMT_RGB555_2X8_PADHI_LE;
-			break;
-		case 	GS_CF_JPEG422:
-		case 	GS_CF_JPEG420:
-		case 	GS_CF_JPEG422EX:
-		case 	GS_CF_JPEG420EX:
-			code->code = MEDIA_BUS_FMT_JPEG_1X8;
-			break;
-		case 	GS_CF_BAYER_16:
-			code->code = MEDIA_BUS_FMT_SRGGB16_1X16;
-			break;
-		case 	GS_CF_BAYER_12:
-			code->code = MEDIA_BUS_FMT_SRGGB12_1X12;
-			break;
-		case 	GS_CF_BAYER_10:
-			code->code = MEDIA_BUS_FMT_SRGGB10_1X10;
-			break;
-		case 	GS_CF_BAYER_8:
-			code->code = MEDIA_BUS_FMT_SRGGB8_1X8;
-			break;
-		default:
-			ret = -EINVAL;
-			break;
+	switch (sel->target) {
+	case V4L2_SEL_TGT_NATIVE_SIZE:
+	case V4L2_SEL_TGT_CROP_BOUNDS:
+	case V4L2_SEL_TGT_CROP_DEFAULT:
+		sel->r.left = 0;
+		sel->r.top = 0;
+		sel->r.width = GS_NATIVE_WIDTH;
+		sel->r.height = GS_NATIVE_HEIGHT;
+		if (sel->target == V4L2_SEL_TGT_CROP_DEFAULT) {
+			mutex_lock(&sensor->lock);
+			gs_ar0234_fov(sensor->fmt.width, sensor->fmt.height, &sel->r);
+			mutex_unlock(&sensor->lock);
+		}
+		return 0;
+	case V4L2_SEL_TGT_CROP:
+		if (sel->which == V4L2_SUBDEV_FORMAT_TRY) {
+			sel->r = *v4l2_subdev_get_try_crop(sd, sd_state, sel->pad);
+			return 0;
+		}
+		mutex_lock(&sensor->lock);
+		gs_ar0234_zoom_to_crop(&sensor->fmt, sensor->ctrls.zoom->cur.val, sensor->ctrls.pan->cur.val, sensor->ctrls.tilt->cur.val, &sel->r);
+		mutex_unlock(&sensor->lock);
+		return 0;
 	}
-	sensor->format_type = code->pad;
-	return ret;
+
+	return -EINVAL;
 }
 
-static int gs_ar0234_s_stream(struct v4l2_subdev *sd, int enable)
+static int gs_ar0234_set_selection(struct v4l2_subdev *sd, struct v4l2_subdev_state *sd_state, struct v4l2_subdev_selection *sel)
 {
 	struct gs_ar0234_dev *sensor = to_gs_ar0234_dev(sd);
+	const struct v4l2_mbus_framefmt *fmt;
+	struct gs_reg regs[3];
+	u32 zoom, pan, tilt;
 	int ret = 0;
 
-	pr_debug("%s: start: csi%d, format: %d\n", __func__, sensor->csi_id, sensor->format_type);
-
-	if (sensor->ep.bus_type != V4L2_MBUS_CSI2_DPHY){
-		dev_err(sensor->dev, "endpoint bus_type not supported: %d\n", sensor->ep.bus_type);
+	if (sel->pad >= NUM_PADS || sel->target != V4L2_SEL_TGT_CROP)
 		return -EINVAL;
-	}
-
-	if (enable)
-	{
-		mutex_lock(&sensor->lock);
-
-		// turn off mipi lanes
-		gs_ar0234_write_reg8(sensor, GS_REG_SET_STATE, FORMAT_CHANGE); // format change state
-
-		// set format type
-		gs_ar0234_write_reg8(sensor, GS_REG_FORMAT_TYPE, sensor->format_type); // format type
-		gs_check_wait(sensor, 10, 150); // wait > 100ms, using 150ms
-
-#if 0
-		// set res, fixed formats reg 0x10,
-		gs_ar0234_write_reg8(sensor, 0x10, sensor->mode->frame_format_code);
-		gs_check_wait(sensor, 10, 150); // wait > 100ms, using 150ms
-#else
-		gs_ar0234_write_reg16(sensor, GS_REG_FORMAT_X, sensor->fmt.width);
-		gs_check_wait(sensor, 10, 150); // wait > 100ms, using 150ms
-		gs_ar0234_write_reg16(sensor, GS_REG_FORMAT_Y, sensor->fmt.height);
-		gs_check_wait(sensor, 10, 150); // wait > 100ms, using 150ms
-#endif
-		// set fr reg- 0x16 (16b = 8b,8b [fraction)]) = 60,50,30,25 or any int
-		gs_ar0234_write_reg16(sensor, GS_REG_FRAMERATE, ((u16)(sensor->framerate) << 8));
 
-		//turn on mipi
-		gs_ar0234_write_reg8(sensor, GS_REG_SET_STATE, FORMAT_DONE); // format change state Done
+	mutex_lock(&sensor->lock);
+	if (sel->which == V4L2_SUBDEV_FORMAT_TRY)
+		fmt = v4l2_subdev_get_try_format(sd, sd_state, sel->pad);
+	else
+		fmt = &sensor->fmt;
 
-		mutex_unlock(&sensor->lock);
+	gs_ar0234_crop_to_zoom(fmt, &sel->r, &zoom, &pan, &tilt);
+	gs_ar0234_zoom_to_crop(fmt, zoom, pan, tilt, &sel->r);
+	dev_dbg(sd->dev, "%s: crop %dx%d@%d,%d -> zoom 0x%x pan 0x%x tilt 0x%x\n", __func__,
+		sel->r.width, sel->r.height, sel->r.left, sel->r.top, zoom, pan, tilt);
 
-		pr_debug("%s: Starting stream at WxH@fps=%dx%d@%d\n", __func__, sensor->fmt.width, sensor->fmt.height, sensor->framerate);
+	if (sel->which == V4L2_SUBDEV_FORMAT_TRY) {
+		*v4l2_subdev_get_try_crop(sd, sd_state, sel->pad) = sel->r;
+		goto out;
 	}
-	else
-		pr_debug("%s: Stopping stream \n", __func__);
 
+	// the whole crop in one transfer, so it lands on one frame; a selection replaces any PTZ move
+	WRITE_ONCE(sensor->ptz.active, false);
+	regs[0] = (struct gs_reg){ GS_REG_ZOOM, 2, zoom };
+	regs[1] = (struct gs_reg){ GS_REG_PAN, 1, pan };
+	regs[2] = (struct gs_reg){ GS_REG_TILT, 1, tilt };
+	ret = gs_ctrl_write_batch(sensor, regs, ARRAY_SIZE(regs));
+	if (ret)
+		goto out;
+
+	// then the control values, which also sends their events
+	ret = gs_ctrl_update(sensor, sensor->ctrls.zoom, zoom);
+	if (!ret)
+		ret = gs_ctrl_update(sensor, sensor->ctrls.pan, pan);
+	if (!ret)
+		ret = gs_ctrl_update(sensor, sensor->ctrls.tilt, tilt);
+out:
+	mutex_unlock(&sensor->lock);
 	return ret;
 }
 
-
 int gs_ar0234_init_cfg(struct v4l2_subdev *sd, struct v4l2_subdev_state *state)
 {
 	struct gs_ar0234_dev *sensor = to_gs_ar0234_dev(sd);
+	struct v4l2_rect *crop;
+
 	dev_info(sensor->dev, "%s \n",__func__);
+
+	// TRY crop starts out at the crop bounds
+	for (int pad = 0; pad < NUM_PADS; pad++) {
+		crop = v4l2_subdev_get_try_crop(sd, state, pad);
+		crop->left = 0;
+		crop->top = 0;
+		crop->width = GS_NATIVE_WIDTH;
+		crop->height = GS_NATIVE_HEIGHT;
+	}
 	return 0;
 }
 
 
+static int gs_ar0234_subscribe_event(struct v4l2_subdev *sd, struct v4l2_fh *fh, struct v4l2_event_subscription *sub)
+{
+	struct gs_ar0234_dev *sensor = to_gs_ar0234_dev(sd);
+	int ret;
+
+	ret = v4l2_ctrl_subdev_subscribe_event(sd, fh, sub);
+	// no-op while the sampler is already queued
+	if (!ret && sub->type == V4L2_EVENT_CTRL && event_poll_ms > 0)
+		schedule_delayed_work(&sensor->event_work, msecs_to_jiffies(event_poll_ms));
+	return ret;
+}
+
 static const struct v4l2_subdev_core_ops gs_ar0234_core_ops = {
 	.s_power = gs_ar0234_s_power,
 	.log_status = v4l2_ctrl_subdev_log_status,
-	.subscribe_event = v4l2_ctrl_subdev_subscribe_event,
+	.subscribe_event = gs_ar0234_subscribe_event,
 	.unsubscribe_event = v4l2_event_subdev_unsubscribe,
 };
 
@@ -1481,7 +2986,10 @@ static const struct v4l2_subdev_pad_ops gs_ar0234_pad_ops = {
 	.get_fmt = ops_get_fmt,
 	.set_fmt = gs_ar0234_set_fmt,
 	.enum_frame_size = ops_enum_frame_size,
-	//.enum_frame_interval = ops_enum_frame_interval,
+	.enum_frame_interval = ops_enum_frame_interval,
+	.get_frame_desc = gs_ar0234_get_frame_desc,
+	.get_selection = gs_ar0234_get_selection,
+	.set_selection = gs_ar0234_set_selection,
 };
 
 static const struct v4l2_subdev_ops gs_ar0234_subdev_ops = {
@@ -1490,6 +2998,200 @@ static const struct v4l2_subdev_ops gs_ar0234_subdev_ops = {
 	.pad = &gs_ar0234_pad_ops,
 };
 
+/* --------------- sysfs: cached firmware identity and statistics, never touches the bus --------------- */
+
+static inline struct gs_ar0234_dev *dev_to_gs_ar0234_dev(struct device *dev)
+{
+	return to_gs_ar0234_dev(dev_get_drvdata(dev));
+}
+
+static ssize_t mcu_version_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	u16 version = dev_to_gs_ar0234_dev(dev)->id.mcu_version;
+
+	return sysfs_emit(buf, "%d.%d\n", version >> 8, version & 0xFF);
+}
+static DEVICE_ATTR_RO(mcu_version);
+
+static ssize_t nvm_version_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	u16 version = dev_to_gs_ar0234_dev(dev)->id.nvm_version;
+
+	return sysfs_emit(buf, "%d.%d\n", version >> 8, version & 0xFF);
+}
+static DEVICE_ATTR_RO(nvm_version);
+
+static ssize_t isp_version_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%d\n", dev_to_gs_ar0234_dev(dev)->id.isp_version);
+}
+static DEVICE_ATTR_RO(isp_version);
+
+static ssize_t camera_type_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	switch (dev_to_gs_ar0234_dev(dev)->id.sensor_type) {
+		case COLOR:			return sysfs_emit(buf, "color\n");
+		case MONOCHROME:	return sysfs_emit(buf, "mono\n");
+		default:			return sysfs_emit(buf, "unknown\n");
+	}
+}
+static DEVICE_ATTR_RO(camera_type);
+
+static ssize_t serial_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%16phN\n", dev_to_gs_ar0234_dev(dev)->id.serial);
+}
+static DEVICE_ATTR_RO(serial);
+
+// latency of the last stream start with (cold) and without (warm) ISP power up
+static ssize_t stream_start_cold_us_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%u\n", dev_to_gs_ar0234_dev(dev)->stream_start_cold_us);
+}
+static DEVICE_ATTR_RO(stream_start_cold_us);
+
+static ssize_t stream_start_warm_us_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%u\n", dev_to_gs_ar0234_dev(dev)->stream_start_warm_us);
+}
+static DEVICE_ATTR_RO(stream_start_warm_us);
+
+// latency of the last stream start that had to (changed) or didn't have to (unchanged) reprogram the format
+static ssize_t stream_start_changed_us_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%u\n", dev_to_gs_ar0234_dev(dev)->stream_start_changed_us);
+}
+static DEVICE_ATTR_RO(stream_start_changed_us);
+
+static ssize_t stream_start_unchanged_us_show(struct device *dev, struct device_attribute *attr, char *buf)
+{
+	return sysfs_emit(buf, "%u\n", dev_to_gs_ar0234_dev(dev)->stream_start_unchanged_us);
+}
+static DEVICE_ATTR_RO(stream_start_unchanged_us);
+
+static struct attribute *gs_ar0234_attrs[] = {
+	&dev_attr_mcu_version.attr,
+	&dev_attr_nvm_version.attr,
+	&dev_attr_isp_version.attr,
+	&dev_attr_camera_type.attr,
+	&dev_attr_serial.attr,
+	&dev_attr_stream_start_cold_us.attr,
+	&dev_attr_stream_start_warm_us.attr,
+	&dev_attr_stream_start_changed_us.attr,
+	&dev_attr_stream_start_unchanged_us.attr,
+	NULL
+};
+
+// created by the driver core once probe succeeded, see .dev_groups
+ATTRIBUTE_GROUPS(gs_ar0234);
+
+/* --------------- Power management --------------- */
+
+static int gs_ar0234_runtime_suspend(struct device *dev)
+{
+	struct gs_ar0234_dev *sensor = dev_to_gs_ar0234_dev(dev);
+	int ret;
+
+	mutex_lock(&sensor->lock);
+	ret = gs_ar0234_power(sensor, GS_POWER_DOWN);
+	// an error here would stick in the PM core and fail every later resume,
+	// the next resume powers the ISP up again anyway
+	if (ret)
+		dev_err(dev, "%s: power down failed: %d\n", __func__, ret);
+	sensor->powered = false;
+	// don't trust the output format after power down, program it in full next time
+	sensor->programmed.valid = false;
+	mutex_unlock(&sensor->lock);
+	pr_debug("---%s: Power down\n",__func__);
+
+	return 0;
+}
+
+static int gs_ar0234_runtime_resume(struct device *dev)
+{
+	struct gs_ar0234_dev *sensor = dev_to_gs_ar0234_dev(dev);
+	int ret;
+
+	mutex_lock(&sensor->lock);
+	ret = gs_ar0234_power(sensor, GS_POWER_UP);
+	if (ret)
+		dev_err(dev, "%s: power up failed: %d\n", __func__, ret);
+	else {
+		sensor->powered = true;
+		// replay control values the ISP lost, e.g. during system sleep
+		ret = gs_shadow_flush(sensor);
+		if (ret)
+			dev_err(dev, "%s: control replay failed: %d\n", __func__, ret);
+	}
+	mutex_unlock(&sensor->lock);
+	pr_debug("---%s: Power up\n",__func__);
+
+	return ret;
+}
+
+/*
+ * The ISP may lose its register state during system sleep. Suspend marks every
+ * control register that differs from its firmware default, resume (or the next
+ * runtime resume if the ISP was idle) writes them back in one batch.
+ */
+static int __maybe_unused gs_ar0234_suspend(struct device *dev)
+{
+	struct gs_ar0234_dev *sensor = dev_to_gs_ar0234_dev(dev);
+	int num;
+
+	// let a running store/restore finish before the ISP loses power
+	flush_work(&sensor->cmd_work);
+
+	mutex_lock(&sensor->lock);
+	num = gs_shadow_mark_dirty(sensor);
+	mutex_unlock(&sensor->lock);
+	dev_dbg(dev, "%s: %d control registers to replay on resume\n", __func__, num);
+
+	return pm_runtime_force_suspend(dev);
+}
+
+static int __maybe_unused gs_ar0234_resume(struct device *dev)
+{
+	struct gs_ar0234_dev *sensor = dev_to_gs_ar0234_dev(dev);
+	ktime_t start = ktime_get();
+	int ret;
+
+	ret = pm_runtime_force_resume(dev);
+	if (ret)
+		return ret;
+
+	mutex_lock(&sensor->lock);
+	if (sensor->streaming)
+		ret = gs_ar0234_program_format(sensor, true);
+	mutex_unlock(&sensor->lock);
+	if (ret < 0) {
+		dev_err(dev, "%s: stream restart failed: %d\n", __func__, ret);
+		return ret;
+	}
+
+	if (sensor->streaming)
+		dev_info(dev, "resume to stream on took %lld us\n", ktime_us_delta(ktime_get(), start));
+	return 0;
+}
+
+static const struct dev_pm_ops gs_ar0234_pm_ops = {
+	SET_SYSTEM_SLEEP_PM_OPS(gs_ar0234_suspend, gs_ar0234_resume)
+	SET_RUNTIME_PM_OPS(gs_ar0234_runtime_suspend, gs_ar0234_runtime_resume, NULL)
+};
+
+static int gs_ar0234_open(struct v4l2_subdev *sd, struct v4l2_subdev_fh *fh)
+{
+	struct gs_ar0234_dev *sensor = to_gs_ar0234_dev(sd);
+
+	// make sure the first control access through the subdev node sees the ISP values
+	flush_work(&sensor->ctrl_sync_work);
+	return 0;
+}
+
+static const struct v4l2_subdev_internal_ops gs_ar0234_internal_ops = {
+	.open = gs_ar0234_open,
+};
+
 static int gs_ar0234_link_setup(struct media_entity *entity, const struct media_pad *local, const struct media_pad *remote, u32 flags)
 {
 	return 0;
@@ -1579,24 +3281,24 @@ static void gs_ar0234_fw_handler(const struct firmware *fw, void *context)
 		dev_info(sensor->dev, "Boot: Loading MCU Firmware: %s (%04x)\n", MCU_FIRMWARE_NAME, MCU_FIRMWARE_VERSION);
 		gs_ar0234_fw_update(fw, sensor);
 		release_firmware(fw);
-		sensor->mcu_version = MCU_FIRMWARE_VERSION;
-		sensor->nvm_version = NVM_FIRMWARE_VERSION;
+		sensor->id.mcu_version = MCU_FIRMWARE_VERSION;
+		sensor->id.nvm_version = NVM_FIRMWARE_VERSION;
 	}
 	else
 	{
-		if(sensor->mcu_version != MCU_FIRMWARE_VERSION)
+		if(sensor->id.mcu_version != MCU_FIRMWARE_VERSION)
 		{
 			sensor->update_type = MCU; // update MCU firmware only
 			dev_info(sensor->dev, "Loading MCU Firmware: %s (%04x)\n", MCU_FIRMWARE_NAME, MCU_FIRMWARE_VERSION);
 			gs_ar0234_fw_update(fw, sensor);
 			release_firmware(fw);
-			sensor->mcu_version = MCU_FIRMWARE_VERSION;
+			sensor->id.mcu_version = MCU_FIRMWARE_VERSION;
 		}
 		else
 			release_firmware(fw);
 
 		// update NVM if version does not match and version number in the conf five is not zero
-		if ( (sensor->nvm_version != nvm_firmware_versions[sensor->csi_id]) && (nvm_firmware_versions[sensor->csi_id] != 0))
+		if ( (sensor->id.nvm_version != nvm_firmware_versions[sensor->csi_id]) && (nvm_firmware_versions[sensor->csi_id] != 0))
 		{
 			if(nvm_firmware_names[sensor->csi_id] != NULL) // firmware name must exist
 			{
@@ -1606,7 +3308,7 @@ static void gs_ar0234_fw_handler(const struct firmware *fw, void *context)
 				{
 					gs_ar0234_fw_update(fw_local,sensor);
 					release_firmware(fw_local);
-					sensor->nvm_version = nvm_firmware_versions[sensor->csi_id];
+					sensor->id.nvm_version = nvm_firmware_versions[sensor->csi_id];
 				}
 				else
 					dev_err(sensor->dev, "request_firmware_direct failed\n");
@@ -1616,29 +3318,28 @@ static void gs_ar0234_fw_handler(const struct firmware *fw, void *context)
 		}
 	}
 
-	ret = gs_ar0234_version(sensor, ISP, &isp_code);
+	// refresh the identity snapshot after MCU/NVM updates
+	ret = gs_read_identity(sensor, &sensor->id);
 	if(ret)
-		dev_err(sensor->dev, "gs_ar0234_version failed\n");
+		dev_err(sensor->dev, "gs_read_identity failed\n");
+	isp_code = sensor->id.isp_version;
 
 	pr_debug("-->%s: ISP version: %04x\n",__func__, isp_code);
 	if(isp_code != ISP_FIRMWARE_VERSION)
 	{
 		sensor->update_type = ISP;
-		ret = gs_get_camera_type(sensor, &sensor->sensor_type);
-		if(ret)
-			dev_err(sensor->dev, "gs_get_camera_type failed\n");
-		pr_debug("---%s: cameratype: %d\n",__func__, sensor->sensor_type);
+		pr_debug("---%s: cameratype: %d\n",__func__, sensor->id.sensor_type);
 
-		if (sensor->sensor_type == COLOR) isp_name=ISP_COLOR_FIRMWARE_NAME;
-		else if (sensor->sensor_type == MONOCHROME) isp_name=ISP_MONO_FIRMWARE_NAME;
+		if (sensor->id.sensor_type == COLOR) isp_name=ISP_COLOR_FIRMWARE_NAME;
+		else if (sensor->id.sensor_type == MONOCHROME) isp_name=ISP_MONO_FIRMWARE_NAME;
 
-		if(sensor->sensor_type != UNKNOWN) // dont update, leave previous ISP image intact
+		if(sensor->id.sensor_type != UNKNOWN) // dont update, leave previous ISP image intact
 		{
 			dev_info(sensor->dev, "Loading ISP Firmware: %s (%04x)\n", isp_name, ISP_FIRMWARE_VERSION);
 			if(request_firmware_direct(&fw_local, ISP_COLOR_FIRMWARE_NAME, sensor->dev) == 0) {
 				gs_ar0234_fw_update(fw_local, sensor);
 				release_firmware(fw_local);
-				sensor->isp_version = ISP_FIRMWARE_VERSION;
+				sensor->id.isp_version = ISP_FIRMWARE_VERSION;
 			}
 			else
 				dev_err(sensor->dev, "request_firmware_direct failed\n");
@@ -1647,16 +3348,15 @@ static void gs_ar0234_fw_handler(const struct firmware *fw, void *context)
 			dev_info(sensor->dev, "Loading ISP Firmware skipped\n");
 	}
 
-	// read register values from Sensor
-	ret = gs_ar0234_i_cntrl(sensor);
-	if (ret)
-		sensor->firmware_loaded = -1;
+	// register values may have changed with the new firmware, read them back lazily (also powers down)
+	mutex_lock(&sensor->lock);
+	sensor->ctrls_synced = false;
+	mutex_unlock(&sensor->lock);
+	schedule_work(&sensor->ctrl_sync_work);
 
-	// Power down
-	ret = gs_ar0234_s_power(&sensor->sd, GS_POWER_DOWN);
-	if (ret)
-		sensor->firmware_loaded = -1;
-	pr_debug("---%s: Power down\n",__func__);
+	// drop the reference probe left for us
+	pm_runtime_mark_last_busy(sensor->dev);
+	pm_runtime_put_autosuspend(sensor->dev);
 	mutex_unlock(&sensor->probe_lock);
 }
 
@@ -1692,11 +3392,13 @@ static int gs_ar0234_probe(struct i2c_client *client, const struct i2c_device_id
 	fmt->ycbcr_enc = V4L2_MAP_YCBCR_ENC_DEFAULT(fmt->colorspace);
 	fmt->quantization = V4L2_QUANTIZATION_FULL_RANGE;
 	fmt->xfer_func = V4L2_MAP_XFER_FUNC_DEFAULT(fmt->colorspace);
-	fmt->width = 1920;
-	fmt->height = 1080;
+	sensor->mode = &gs_ar0234_modes[GS_DEFAULT_MODE];
+	fmt->width = sensor->mode->width;
+	fmt->height = sensor->mode->height;
 	fmt->field = V4L2_FIELD_NONE;
-	sensor->framerate = 30;
+	sensor->framerate = GS_FPS(30);
 	sensor->mbus_num = GS_CF_YUV422;
+	sensor->format_type = GS_CF_YUV422;
 	sensor->update_type = NONE;
 	sensor->dev = dev;
 
@@ -1715,13 +3417,24 @@ static int gs_ar0234_probe(struct i2c_client *client, const struct i2c_device_id
 		return -EINVAL;
 	}
 
-	ret = v4l2_fwnode_endpoint_parse(endpoint, &sensor->ep);
+	ret = v4l2_fwnode_endpoint_alloc_parse(endpoint, &sensor->ep);
 	fwnode_handle_put(endpoint);
 	if (ret) {
 		dev_err(dev, "Could not parse endpoint\n");
 		return ret;
 	}
 
+	// keep the link frequencies for the LINK_FREQ/PIXEL_RATE controls, the rest of ep stays valid
+	if (sensor->ep.nr_of_link_frequencies) {
+		sensor->link_freqs = devm_kmemdup(dev, sensor->ep.link_frequencies,
+			sensor->ep.nr_of_link_frequencies * sizeof(*sensor->ep.link_frequencies), GFP_KERNEL);
+		if (sensor->link_freqs)
+			sensor->num_link_freqs = sensor->ep.nr_of_link_frequencies;
+	} else {
+		dev_warn(dev, "no link-frequencies in the endpoint, link bandwidth is not checked\n");
+	}
+	v4l2_fwnode_endpoint_free(&sensor->ep);
+
 	pr_debug("---%s: 1 sensor->ep.bus_type=%d\n", __func__, sensor->ep.bus_type);
 
 	if (sensor->ep.bus_type != V4L2_MBUS_CSI2_DPHY) {
@@ -1738,10 +3451,21 @@ static int gs_ar0234_probe(struct i2c_client *client, const struct i2c_device_id
 
 	mutex_init(&sensor->lock);
 	mutex_init(&sensor->probe_lock);
-
-	// Power Up
-	ret = gs_ar0234_s_power(&sensor->sd, GS_POWER_UP);
+	INIT_WORK(&sensor->ctrl_sync_work, gs_ar0234_ctrl_sync_work);
+	INIT_WORK(&sensor->prestage_work, gs_ar0234_prestage_work);
+	INIT_WORK(&sensor->cmd_work, gs_ar0234_cmd_work);
+	INIT_DELAYED_WORK(&sensor->event_work, gs_ar0234_event_work);
+	INIT_WORK(&sensor->ratelimit_work, gs_ar0234_ratelimit_work);
+	hrtimer_init(&sensor->ratelimit_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+	sensor->ratelimit_timer.function = gs_ar0234_ratelimit_tick;
+	INIT_WORK(&sensor->ptz.work, gs_ptz_work);
+	hrtimer_init(&sensor->ptz.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+	sensor->ptz.timer.function = gs_ptz_tick;
+
+	// Power Up, runtime PM takes over once the subdev is set up
+	ret = gs_ar0234_power(sensor, GS_POWER_UP);
 	if (ret) return -EIO;
+	sensor->powered = true;
 	pr_debug("---%s: Power up\n",__func__);
 
 #ifdef DEBUG
@@ -1774,19 +3498,13 @@ static int gs_ar0234_probe(struct i2c_client *client, const struct i2c_device_id
 	}
 	else  // else if one of the firmware versions need updating, then update
 	{
-		// get firmware versions
-		ret = gs_ar0234_version(sensor, MCU, &mcu_code);
-		if (ret) return -EIO;
-
-		ret = gs_ar0234_version(sensor, NVM, &nvm_code);
-		if (ret) return -EIO;
-
-		ret = gs_ar0234_version(sensor, ISP, &isp_code);
+		// get firmware versions, camera type and serial number in one transfer
+		ret = gs_read_identity(sensor, &sensor->id);
 		if (ret) return -EIO;
 
-		sensor->mcu_version = mcu_code;
-		sensor->nvm_version = nvm_code;
-		sensor->isp_version = isp_code;
+		mcu_code = sensor->id.mcu_version;
+		nvm_code = sensor->id.nvm_version;
+		isp_code = sensor->id.isp_version;
 
 		pr_debug("---%s: Firmware versions: %04x %04x %04x\n", __func__, mcu_code, nvm_code, isp_code);
 		if((mcu_code != MCU_FIRMWARE_VERSION) || (nvm_code != nvm_firmware_versions[sensor->csi_id]) || (isp_code != ISP_FIRMWARE_VERSION))
@@ -1801,10 +3519,14 @@ static int gs_ar0234_probe(struct i2c_client *client, const struct i2c_device_id
 		}
 	}
 
-	ret = gs_get_camera_type(sensor, &sensor->sensor_type);
-	if (ret) return -EINVAL;
+	if(sensor->update_type == BOOT) // identity snapshot is taken after the update
+	{
+		ret = gs_get_camera_type(sensor, &sensor->id.sensor_type);
+		if (ret) return -EINVAL;
+	}
 
 	v4l2_i2c_subdev_init(&sensor->sd, client, &gs_ar0234_subdev_ops);
+	sensor->sd.internal_ops = &gs_ar0234_internal_ops;
 
 	sensor->sd.flags |= V4L2_SUBDEV_FL_HAS_EVENTS | V4L2_SUBDEV_FL_HAS_DEVNODE;
 	sensor->sd.dev = &client->dev;
@@ -1819,23 +3541,27 @@ static int gs_ar0234_probe(struct i2c_client *client, const struct i2c_device_id
 	if (ret)
 		goto entity_cleanup;
 
+	// the ISP is powered, hold a reference until the controls are read back (or the firmware handler is done)
+	pm_runtime_set_active(dev);
+	pm_runtime_get_noresume(dev);
+	pm_runtime_enable(dev);
+	pm_runtime_set_autosuspend_delay(dev, autosuspend_delay_ms);
+	pm_runtime_use_autosuspend(dev);
+
 	ret = v4l2_async_register_subdev_sensor(&sensor->sd);
 	if (ret)
-		goto free_ctrls;
+		goto disable_pm;
 
-	if(update == false) // if firmware update was performed dont do this
-	{
-		// read register values from Sensor
-		ret = gs_ar0234_i_cntrl(sensor);
-		if (ret)
-			goto free_ctrls;
+	sensor->debugfs = debugfs_create_dir(dev_name(dev), gs_ar0234_debugfs_root);
+	debugfs_create_u32("writes_suppressed", 0444, sensor->debugfs, &sensor->shadow.suppressed);
 
-		// Power down
-		ret = gs_ar0234_s_power(&sensor->sd, GS_POWER_DOWN);
-		if (ret)
-			goto free_ctrls;
-		pr_debug("---%s: Power down\n",__func__);
-	} // if firmware update was performed untill here
+	if(update == false) // if firmware update was performed the firmware handler does this
+	{
+		// read register values from Sensor in the background, then power down
+		schedule_work(&sensor->ctrl_sync_work);
+		pm_runtime_mark_last_busy(dev);
+		pm_runtime_put_autosuspend(dev);
+	}
 
 	pr_debug("<--%s: gs_ar0234 Probe end successful, return\n",__func__);
 	mutex_unlock(&sensor->probe_lock);
@@ -1843,7 +3569,11 @@ static int gs_ar0234_probe(struct i2c_client *client, const struct i2c_device_id
 
 	return 0;
 
-free_ctrls:
+disable_pm:
+	pm_runtime_dont_use_autosuspend(dev);
+	pm_runtime_disable(dev);
+	pm_runtime_set_suspended(dev);
+	pm_runtime_put_noidle(dev);
 	v4l2_ctrl_handler_free(&sensor->ctrls.handler);
 entity_cleanup:
 	pr_debug("<--%s: gs_ar0234 ERR entity_cleanup\n",__func__);
@@ -1861,7 +3591,26 @@ static void gs_ar0234_remove(struct i2c_client *client)
 	struct v4l2_subdev *sd = i2c_get_clientdata(client);
 	struct gs_ar0234_dev *sensor = to_gs_ar0234_dev(sd);
 
+	// no more ioctls or debugfs access can arm the timers and works below
 	v4l2_async_unregister_subdev(&sensor->sd);
+	debugfs_remove_recursive(sensor->debugfs);
+
+	cancel_work_sync(&sensor->ctrl_sync_work);
+	cancel_work_sync(&sensor->prestage_work);
+	flush_work(&sensor->cmd_work);
+	cancel_delayed_work_sync(&sensor->event_work);
+	hrtimer_cancel(&sensor->ratelimit_timer);
+	cancel_work_sync(&sensor->ratelimit_work);
+	gs_ptz_stop(sensor);
+	// the works above use the controls
+	v4l2_ctrl_handler_free(&sensor->ctrls.handler);
+
+	pm_runtime_dont_use_autosuspend(&client->dev);
+	pm_runtime_disable(&client->dev);
+	if (!pm_runtime_status_suspended(&client->dev))
+		gs_ar0234_power(sensor, GS_POWER_DOWN);
+	pm_runtime_set_suspended(&client->dev);
+
 	media_entity_cleanup(&sensor->sd.entity);
 	mutex_destroy(&sensor->lock);
 #if LINUX_VERSION_CODE < KERNEL_VERSION(6, 0, 0)
@@ -1886,13 +3635,34 @@ static struct i2c_driver gs_ar0234_i2c_driver = {
 		.owner = THIS_MODULE,
 		.name  = "gs_ar0234",
 		.of_match_table	= gs_ar0234_dt_ids,
+		.pm = &gs_ar0234_pm_ops,
+		.dev_groups = gs_ar0234_groups,
 	},
 	.id_table = gs_ar0234_id,
 	.probe = gs_ar0234_probe,
 	.remove = gs_ar0234_remove,
 };
 
-module_i2c_driver(gs_ar0234_i2c_driver);
+static int __init gs_ar0234_init(void)
+{
+	int ret;
+
+	// one directory per device below it
+	gs_ar0234_debugfs_root = debugfs_create_dir("cam_ar0234", NULL);
+
+	ret = i2c_add_driver(&gs_ar0234_i2c_driver);
+	if (ret)
+		debugfs_remove_recursive(gs_ar0234_debugfs_root);
+	return ret;
+}
+module_init(gs_ar0234_init);
+
+static void __exit gs_ar0234_exit(void)
+{
+	i2c_del_driver(&gs_ar0234_i2c_driver);
+	debugfs_remove_recursive(gs_ar0234_debugfs_root);
+}
+module_exit(gs_ar0234_exit);
 
 MODULE_DESCRIPTION("gs_ar0234 MIPI Camera Subdev Driver");
 MODULE_LICENSE("GPL");
@@ -4,7 +4,10 @@
 #ifndef INCLUDES_CAM_AR0234_H_
 #define INCLUDES_CAM_AR0234_H_
 
+#include <linux/bitmap.h>
 #include <linux/delay.h>
+#include <linux/hrtimer.h>
+#include <linux/workqueue.h>
 #include <media/v4l2-ctrls.h>
 #include <media/v4l2-fwnode.h>
 #include <media/v4l2-subdev.h>
@@ -20,6 +23,8 @@
 
 #define MAX_CAMERA_DEVICES 10
 
+#define GS_NUM_REGS			256 // 8 bit register address space of the mainapp
+
 #define V4L2_CID_CAMERA_CAM_AR0234 	(V4L2_CID_CAMERA_CLASS_BASE+50) 		//camera controls for CAM_AR0234
 #define V4L2_CID_USER_CAM_AR0234 	(V4L2_CID_USER_BASE+2000) 				//user controls for CAM_AR0234
 #define V4L2_CID_DETECT_CAM_AR0234 	(V4L2_CID_DETECT_CLASS_BASE+50) 		//detect controls for CAM_AR0234
@@ -48,6 +53,15 @@
 #define V4L2_CID_RESTORE_REGISTERS  (V4L2_CID_CAMERA_CAM_AR0234+21)
 #define V4L2_CID_RESTORE_FACTORY 	(V4L2_CID_CAMERA_CAM_AR0234+22) // restores both registers and calibration parameters
 #define V4L2_CID_REBOOT         	(V4L2_CID_CAMERA_CAM_AR0234+23) 
+#define V4L2_CID_PTZ_ZOOM_SPEED		(V4L2_CID_CAMERA_CAM_AR0234+24) // trajectory speeds, 0 jumps to the target
+#define V4L2_CID_PTZ_PAN_SPEED		(V4L2_CID_CAMERA_CAM_AR0234+25)
+#define V4L2_CID_PTZ_TILT_SPEED		(V4L2_CID_CAMERA_CAM_AR0234+26)
+#define V4L2_CID_PTZ_RAMP			(V4L2_CID_CAMERA_CAM_AR0234+27)
+#define V4L2_CID_ZOOM_CURRENT		(V4L2_CID_CAMERA_CAM_AR0234+28)
+#define V4L2_CID_PTZ_PRESET			(V4L2_CID_CAMERA_CAM_AR0234+29) // slot for store and recall
+#define V4L2_CID_PTZ_PRESET_STORE	(V4L2_CID_CAMERA_CAM_AR0234+30)
+#define V4L2_CID_PTZ_PRESET_RECALL	(V4L2_CID_CAMERA_CAM_AR0234+31)
+#define V4L2_CID_CMD_STATUS			(V4L2_CID_CAMERA_CAM_AR0234+32) // -EINPROGRESS while a store/restore/reboot runs, then its result
 
 // User controls
 #define V4L2_CID_NOISE_RED      	(V4L2_CID_USER_CAM_AR0234+0)
@@ -74,12 +88,22 @@ struct resolution {
 	char *name;
 };
 
+struct gs_ar0234_format {
+	u32 code;	/* MEDIA_BUS_FMT_* */
+	u8  bpp;	/* bits per pixel on the CSI-2 bus */
+	u8  colorformat;	/* GS_REG_FORMAT_TYPE value, enum colorformat */
+	u8  csi2_dt;	/* CSI-2 data type of the packets, for the frame descriptor */
+};
+
 struct gs_ar0234_ctrls {
 	struct v4l2_ctrl_handler handler;
-	// struct v4l2_ctrl *pixel_rate;
+	struct v4l2_ctrl *pixel_rate;
+	struct v4l2_ctrl *link_freq;
+	/* cluster: auto_exp .. exposure */
 	struct v4l2_ctrl *auto_exp;
-	struct v4l2_ctrl *exposure;
 	struct v4l2_ctrl *exposure_absolute;
+	struct v4l2_ctrl *gain;
+	struct v4l2_ctrl *exposure;
 	struct v4l2_ctrl *exposure_metering; // =blc mode
 	struct v4l2_ctrl *exposure_upper;
 	struct v4l2_ctrl *exposure_max;
@@ -102,16 +126,16 @@ struct gs_ar0234_ctrls {
 	struct v4l2_ctrl *face_chroma_threshold;
 	struct v4l2_ctrl *face_min_size;
 	struct v4l2_ctrl *face_max_size;
+	/* cluster: auto_wb .. awb_man_y */
 	struct v4l2_ctrl *auto_wb;
-	struct v4l2_ctrl *push_to_white;
 	struct v4l2_ctrl *wb_temp;
+	struct v4l2_ctrl *awb_man_x;
+	struct v4l2_ctrl *awb_man_y;
+	struct v4l2_ctrl *push_to_white;
 	struct v4l2_ctrl *wb_preset;
 	// struct v4l2_ctrl *blue_balance;
 	// struct v4l2_ctrl *red_balance;
-	struct v4l2_ctrl *awb_man_x;
-	struct v4l2_ctrl *awb_man_y;
 	// struct v4l2_ctrl *auto_gain;
-	struct v4l2_ctrl *gain;
 	struct v4l2_ctrl *brightness;
 	// struct v4l2_ctrl *light_freq;
 	struct v4l2_ctrl *saturation;
@@ -123,19 +147,143 @@ struct gs_ar0234_ctrls {
 	struct v4l2_ctrl *roi_mode_2;
 	struct v4l2_ctrl *gamma;
 	// struct v4l2_ctrl *hue;
+	/* cluster: hflip, vflip */
 	struct v4l2_ctrl *hflip;
 	struct v4l2_ctrl *vflip;
 	struct v4l2_ctrl *powerline;
 	struct v4l2_ctrl *testpattern;
 	struct v4l2_ctrl *colorfx;
+	struct v4l2_ctrl *jpeg_subsampling;
+	/* cluster: zoom, pan, tilt */
 	struct v4l2_ctrl *zoom;
-	struct v4l2_ctrl *zoom_speed;
 	struct v4l2_ctrl *pan;
 	struct v4l2_ctrl *tilt;
+	struct v4l2_ctrl *zoom_speed;
+	struct v4l2_ctrl *ptz_zoom_speed;
+	struct v4l2_ctrl *ptz_pan_speed;
+	struct v4l2_ctrl *ptz_tilt_speed;
+	struct v4l2_ctrl *ptz_ramp;
+	struct v4l2_ctrl *zoom_current;
+	struct v4l2_ctrl *ptz_preset;
+	struct v4l2_ctrl *ptz_preset_store;
+	struct v4l2_ctrl *ptz_preset_recall;
 	struct v4l2_ctrl *store_registers;
 	struct v4l2_ctrl *restore_registers;
 	struct v4l2_ctrl *restore_factory;
 	struct v4l2_ctrl *reboot;
+	struct v4l2_ctrl *cmd_status;
+};
+
+/* firmware identity, read once in a single transfer by gs_read_identity() */
+struct gs_ar0234_identity {
+	u16 mcu_version;
+	u16 nvm_version;
+	u16 isp_version;
+	u8  sensor_type;
+	u8  serial[16];
+};
+
+/**
+ * one register of a batched transfer, see gs_ar0234_read_regs()
+ */
+struct gs_reg {
+	u8  addr;
+	u8  size;	// register width in bytes: 1, 2 or 4
+	u32 val;
+};
+
+/* driver side copy of the control registers, indexed by register address */
+struct gs_reg_shadow {
+	u32 val[GS_NUM_REGS];	/* last value written or read back */
+	u32 def[GS_NUM_REGS];	/* firmware value at the last read back */
+	u8  size[GS_NUM_REGS];
+	DECLARE_BITMAP(valid, GS_NUM_REGS);	/* val is known */
+	DECLARE_BITMAP(has_def, GS_NUM_REGS);	/* def is known */
+	DECLARE_BITMAP(pending, GS_NUM_REGS);	/* val still has to be written to the ISP */
+	DECLARE_BITMAP(live, GS_NUM_REGS);	/* changed by the ISP itself (AE/AWB), never deduplicated */
+	DECLARE_BITMAP(ratelimited, GS_NUM_REGS);	/* written at most once per frame period */
+	ktime_t stamp[GS_NUM_REGS];	/* time of the last write to the ISP */
+	u32 suppressed;		/* writes skipped because the register already held the value */
+};
+
+/*
+ * A V4L2 control backed by a control register, or a bit field of one. The
+ * generic write and read back paths in cam_ar0234.c work from a table of these.
+ */
+struct gs_ctrl_desc {
+	u32 id;
+	size_t ctrl;		/* offsetof() the control pointer in struct gs_ar0234_ctrls */
+	u8  reg;
+	u8  size;		/* register width in bytes */
+	u8  shift;		/* bit field position, only used with a mask */
+	u8  mask;		/* bit field mask before shifting, 0 for the whole register */
+	u8  flags;		/* GS_CTRL_* */
+	u32 (*to_reg)(s32 val);	/* control value to register value, NULL for 1:1 */
+	s32 (*from_reg)(u32 reg);	/* and back */
+};
+
+#define GS_CTRL_SIGNED		0x01	/* sign extend the register on read back */
+#define GS_CTRL_VOLATILE	0x02	/* read from the ISP on every get */
+#define GS_CTRL_CUSTOM_WRITE	0x04	/* written by its own case in s_ctrl, only read back from the table */
+#define GS_CTRL_RATE_LIMIT	0x08	/* slider, see ratelimit_sliders */
+#define GS_CTRL_FW_DRIVEN	0x10	/* also changed by the firmware, see event_poll_ms */
+
+/* registers behind the volatile controls, read together and shared by all readers */
+#define GS_SNAPSHOT_REGS	6
+struct gs_ctrl_snapshot {
+	bool valid;
+	ktime_t stamp;		/* time of the last read */
+	int num;
+	struct gs_reg regs[GS_SNAPSHOT_REGS];
+};
+
+/*
+ * Kernel side zoom/pan/tilt trajectory. Axes are in the order of the zoom
+ * cluster, positions and velocities in 1/256 register steps.
+ */
+enum { GS_PTZ_ZOOM, GS_PTZ_PAN, GS_PTZ_TILT, GS_PTZ_AXES };
+struct gs_ptz {
+	bool active;		/* timer is running, targets not reached yet */
+	s64 pos[GS_PTZ_AXES];
+	s64 vel[GS_PTZ_AXES];	/* per second */
+	s32 target[GS_PTZ_AXES];	/* register values */
+	ktime_t last;		/* time of the last step */
+	struct hrtimer timer;	/* one step per frame period */
+	struct work_struct work;
+};
+
+/*
+ * PTZ presets, kept in the NVM user calibration page and mirrored in RAM.
+ * Each slot is a GS_PTZ_PRESET_SIZE byte record: magic, zoom (big endian),
+ * pan, tilt, zoom speed and two reserved bytes.
+ */
+#define GS_PTZ_PRESETS		8
+#define GS_PTZ_PRESET_PAGE	1	/* NVM_USER_CAL */
+#define GS_PTZ_PRESET_SIZE	8
+/*
+ * Every NVM page ends in a version at 0xFC-0xFD and the CRC-16 (gs_crc(), seed
+ * 0xFFFF) of bytes 0x00-0xFD at 0xFE-0xFF, little endian. The presets sit right
+ * below, a store writes the CRC again.
+ */
+#define GS_NVM_PAGE_SIZE	256
+#define GS_NVM_CRC_ADDR		0xFE
+#define GS_PTZ_PRESET_ADDR	(0xFC - GS_PTZ_PRESETS * GS_PTZ_PRESET_SIZE)
+#define GS_PTZ_PRESET_MAGIC	0x5A	/* erased flash reads 0xFF */
+struct gs_ptz_preset {
+	bool valid;
+	u16 zoom;
+	u8  pan;
+	u8  tilt;
+	s8  zoom_speed;
+};
+
+/* output format last programmed into the ISP, see gs_ar0234_program_format() */
+struct gs_stream_cfg {
+	bool valid;
+	u8  format_type;
+	u16 width;
+	u16 height;
+	u16 framerate;	/* GS_REG_FRAMERATE value, 8.8 fixed point fps */
 };
 
 struct gs_ar0234_dev {
@@ -145,20 +293,43 @@ struct gs_ar0234_dev {
 	struct v4l2_subdev sd;
 	struct media_pad pad;
 	struct v4l2_fwnode_endpoint ep; /* the parsed DT endpoint info */
+	const s64 *link_freqs;	/* link-frequencies of the endpoint */
+	unsigned int num_link_freqs;
 	struct gpio_desc *reset_gpio;
 	struct mutex lock;
 	struct mutex probe_lock;
 	struct v4l2_mbus_framefmt fmt;
 	struct gs_ar0234_ctrls ctrls;
-	//const struct resolution *mode;
+	bool ctrls_synced; /* control values have been read back from the ISP */
+	struct work_struct ctrl_sync_work;
+	struct work_struct prestage_work; /* programs the format ahead of s_stream, see prestage_format */
+	struct work_struct cmd_work;	/* runs store/restore/factory/reboot off the control ioctl */
+	u32 cmd;		/* control id of the command cmd_work runs, 0 when idle */
+	struct delayed_work event_work;	/* samples GS_CTRL_FW_DRIVEN controls for control events */
+	bool powered;		/* ISP is out of GS_REG_POWER sleep, tracked by runtime PM */
+	bool streaming;		/* s_stream(1) holds a runtime PM reference */
+	bool standby;		/* ISP is in FORMAT_CHANGE with MIPI off, only meaningful while programmed.valid */
+	int power_count;	/* references taken through the legacy .s_power op */
+	u32 stream_start_cold_us;	/* last s_stream(1) latency including power up */
+	u32 stream_start_warm_us;	/* last s_stream(1) latency with the ISP already up */
+	u32 stream_start_changed_us;	/* last s_stream(1) latency that reprogrammed the format */
+	u32 stream_start_unchanged_us;	/* last s_stream(1) latency with the format already in place */
+	struct gs_stream_cfg programmed;
+	struct hrtimer ratelimit_timer;	/* commits slider values held back by ratelimit_sliders */
+	struct work_struct ratelimit_work;	/* and the write it triggers, independent of streaming */
+	bool ctrl_update;	/* s_ctrl only takes over the value, see gs_ctrl_update() */
+	struct gs_ptz ptz;
+	struct gs_ptz_preset presets[GS_PTZ_PRESETS];
+	bool presets_loaded;	/* presets have been read from NVM */
+	struct gs_reg_shadow shadow;
+	struct gs_ctrl_snapshot snapshot;	/* live AE/AWB values, see volatile_cache_ms */
+	struct dentry *debugfs;
+	const struct resolution *mode; /* entry of the mode table matching fmt */
 	int mbus_num;
-	int framerate;
+	u32 framerate; /* GS_REG_FRAMERATE value: fps in 8.8 fixed point */
 	int firmware_loaded;
 	int update_type;
-	u16 mcu_version;
-	u16 nvm_version;
-	u16 isp_version;
-	u8  sensor_type;
+	struct gs_ar0234_identity id;
 	u8  format_type;
 	int csi_id;
 };
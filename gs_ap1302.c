@@ -3,6 +3,7 @@
  */
 
 #include <linux/i2c.h>
+#include <linux/slab.h>
 #include <linux/types.h>
 
 
@@ -246,6 +247,149 @@ int gs_ar0234_write_reg32(struct gs_ar0234_dev *sensor, u8 addr, u32 val)
 	return 0;
 }
 
+/*
+ * batched register access - mainapp
+ *
+ * Every register becomes a write/read message pair of a single i2c_transfer(),
+ * so a block of registers costs one bus transaction (and one retry loop)
+ * instead of one per register.
+ */
+
+static u8 gs_read_cmd(u8 size)
+{
+	switch (size) {
+		case 4:		return GS_COMD_32BIT_REG_R;
+		case 2:		return GS_COMD_16BIT_REG_R;
+		default:	return GS_COMD_8BIT_REG_R;
+	}
+}
+
+// max number of registers in one transfer, honouring the adapter limits
+static int gs_batch_len(struct i2c_adapter *adap, int msgs_per_reg)
+{
+	if (adap->quirks && adap->quirks->max_num_msgs)
+		return max(adap->quirks->max_num_msgs / msgs_per_reg, 1);
+	return INT_MAX;
+}
+
+int gs_ar0234_read_regs(struct gs_ar0234_dev *sensor, struct gs_reg *regs, int num)
+{
+	struct i2c_client *client = sensor->i2c_client;
+	struct i2c_msg *msg;
+	u8 *buf;
+	int i, n, chunk, ret = 0;
+
+	if (num <= 0) return 0;
+
+	msg = kcalloc(num * 2, sizeof(*msg), GFP_KERNEL);
+	buf = kcalloc(num, 6, GFP_KERNEL); // 2 bytes command, 4 bytes data per register
+	if (!msg || !buf) {
+		ret = -ENOMEM;
+		goto exit;
+	}
+
+	for (i = 0; i < num; i++) {
+		u8 *cmd = &buf[i * 6];
+
+		cmd[0] = gs_read_cmd(regs[i].size);
+		cmd[1] = regs[i].addr;
+
+		msg[i * 2].addr = client->addr;
+		msg[i * 2].flags = client->flags;
+		msg[i * 2].buf = cmd;
+		msg[i * 2].len = 2;
+
+		msg[i * 2 + 1].addr = client->addr;
+		msg[i * 2 + 1].flags = client->flags | I2C_M_RD;
+		msg[i * 2 + 1].buf = &cmd[2];
+		msg[i * 2 + 1].len = regs[i].size;
+	}
+
+	chunk = gs_batch_len(client->adapter, 2);
+	for (i = 0; i < num; i += n) {
+		n = min(num - i, chunk);
+		ret = gs_ar0234_i2c_trx_retry(client->adapter, &msg[i * 2], n * 2);
+		if (ret < 0) {
+			dev_err(&client->dev, "%s: error: addr=%x, err=%d\n", __func__, regs[i].addr, ret);
+			goto exit;
+		}
+	}
+	ret = 0;
+
+	for (i = 0; i < num; i++) {
+		u8 *data = &buf[i * 6 + 2];
+
+		regs[i].val = data[0];
+		if (regs[i].size >= 2)
+			regs[i].val |= (u32)data[1] << 8;
+		if (regs[i].size == 4)
+			regs[i].val |= ((u32)data[2] << 16) | ((u32)data[3] << 24);
+	}
+
+exit:
+	kfree(buf);
+	kfree(msg);
+	return ret;
+}
+
+static u8 gs_write_cmd(u8 size)
+{
+	switch (size) {
+		case 4:		return GS_COMD_32BIT_REG_W;
+		case 2:		return GS_COMD_16BIT_REG_W;
+		default:	return GS_COMD_8BIT_REG_W;
+	}
+}
+
+int gs_ar0234_write_regs(struct gs_ar0234_dev *sensor, const struct gs_reg *regs, int num)
+{
+	struct i2c_client *client = sensor->i2c_client;
+	struct i2c_msg *msg;
+	u8 *buf;
+	int i, n, chunk, ret = 0;
+
+	if (num <= 0) return 0;
+
+	msg = kcalloc(num, sizeof(*msg), GFP_KERNEL);
+	buf = kcalloc(num, 6, GFP_KERNEL); // 2 bytes command, 4 bytes data per register
+	if (!msg || !buf) {
+		ret = -ENOMEM;
+		goto exit;
+	}
+
+	for (i = 0; i < num; i++) {
+		u8 *cmd = &buf[i * 6];
+
+		cmd[0] = gs_write_cmd(regs[i].size);
+		cmd[1] = regs[i].addr;
+		cmd[2] = regs[i].val & 0xff;
+		cmd[3] = (regs[i].val >> 8) & 0xff;
+		cmd[4] = (regs[i].val >> 16) & 0xff;
+		cmd[5] = (regs[i].val >> 24) & 0xff;
+
+		msg[i].addr = client->addr;
+		msg[i].flags = client->flags;
+		msg[i].buf = cmd;
+		msg[i].len = 2 + regs[i].size;
+	}
+
+	chunk = gs_batch_len(client->adapter, 1);
+	for (i = 0; i < num; i += n) {
+		n = min(num - i, chunk);
+		ret = gs_ar0234_i2c_trx_retry(client->adapter, &msg[i], n);
+		if (ret < 0) {
+			dev_err(&client->dev, "%s: error: addr=%x, err=%d\n", __func__, regs[i].addr, ret);
+			goto exit;
+		}
+	}
+	ret = 0;
+
+exit:
+	kfree(buf);
+	kfree(msg);
+	return ret;
+}
+
 /**
  * functions - mainapp
  */
@@ -332,6 +476,63 @@ int gs_read_serial(struct gs_ar0234_dev *sensor, u8 * buf)
 	return 0;
 }
 
+/**
+ * read firmware versions, camera type and serial number as one batched transfer
+ */
+int gs_read_identity(struct gs_ar0234_dev *sensor, struct gs_ar0234_identity *id)
+{
+	static const u8 addrs[] = {
+		GS_REG_MCU_MAJOR_VERSION, GS_REG_MCU_MINOR_VERSION,
+		GS_REG_NVM_MAJOR_VERSION, GS_REG_NVM_MINOR_VERSION,
+		GS_REG_ISP_MAJOR_VERSION, GS_REG_ISP_MINOR_VERSION,
+		GS_REG_CAMERA_TYPE,
+	};
+	struct i2c_client *client = sensor->i2c_client;
+	struct i2c_msg msg[(ARRAY_SIZE(addrs) + 1) * 2];
+	u8 cmd[ARRAY_SIZE(addrs) + 1][2];
+	u8 val[ARRAY_SIZE(addrs)];
+	const int num = ARRAY_SIZE(addrs) + 1; // registers + serial number
+	int i, n, chunk, ret;
+
+	for (i = 0; i < num; i++) {
+		msg[i * 2].addr = client->addr;
+		msg[i * 2].flags = client->flags;
+		msg[i * 2].buf = cmd[i];
+
+		msg[i * 2 + 1].addr = client->addr;
+		msg[i * 2 + 1].flags = client->flags | I2C_M_RD;
+
+		if (i < ARRAY_SIZE(addrs)) {
+			cmd[i][0] = GS_COMD_8BIT_REG_R;
+			cmd[i][1] = addrs[i];
+			msg[i * 2].len = 2;
+			msg[i * 2 + 1].buf = &val[i];
+			msg[i * 2 + 1].len = 1;
+		} else {
+			cmd[i][0] = GS_COMD_R_SERIAL;
+			msg[i * 2].len = 1;
+			msg[i * 2 + 1].buf = id->serial;
+			msg[i * 2 + 1].len = sizeof(id->serial);
+		}
+	}
+
+	chunk = gs_batch_len(client->adapter, 2);
+	for (i = 0; i < num; i += n) {
+		n = min(num - i, chunk);
+		ret = gs_ar0234_i2c_trx_retry(client->adapter, &msg[i * 2], n * 2);
+		if (ret < 0) {
+			dev_err(&client->dev, "%s: error: err=%d\n", __func__, ret);
+			return ret;
+		}
+	}
+
+	id->mcu_version = ((u16)val[0] << 8) | val[1];
+	id->nvm_version = ((u16)val[2] << 8) | val[3];
+	id->isp_version = ((u16)val[4] << 8) | val[5];
+	id->sensor_type = val[6];
+	return 0;
+}
+
 int gs_set_password(struct gs_ar0234_dev *sensor, u16 password)
 {
 	int ret = gs_ar0234_write_reg8(sensor, 0xFC, password & 0xFF);
@@ -450,6 +651,7 @@ int gs_ar0234_write_nvm(struct gs_ar0234_dev *sensor, u8 page, u8 addr, u8 size,
 	ret = gs_ar0234_i2c_trx_retry(client->adapter, &msg, 1);
 	if (ret < 0) {
 		dev_err(&client->dev, "%s: error: addr=%x, err=%d\n", __func__, addr, ret);
+		return ret;
 	}
 	return 0;
 }
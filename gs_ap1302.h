@@ -61,6 +61,7 @@ enum regs {
 	GS_REG_FORMAT_Y					= 0x14,
 	GS_REG_FRAMERATE				= 0x16,
 	GS_REG_ZOOM						= 0x18,
+	GS_REG_ZOOM_CURRENT				= 0x1A,	// read only, zoom the ISP is at right now
 	GS_REG_ZOOM_SPEED				= 0x1C,
 	GS_REG_PAN						= 0x1D,
 	GS_REG_TILT						= 0x1E,
@@ -164,11 +165,14 @@ int gs_ar0234_read_reg32(struct gs_ar0234_dev *sensor, u8 addr, u32 *val);
 int gs_ar0234_write_reg8(struct gs_ar0234_dev *sensor, u8 addr, u8 val);
 int gs_ar0234_write_reg16(struct gs_ar0234_dev *sensor, u8 addr, u16 val);
 int gs_ar0234_write_reg32(struct gs_ar0234_dev *sensor, u8 addr, u32 val);
+int gs_ar0234_read_regs(struct gs_ar0234_dev *sensor, struct gs_reg *regs, int num);
+int gs_ar0234_write_regs(struct gs_ar0234_dev *sensor, const struct gs_reg *regs, int num);
 
 // funtions - mainapp
 int gs_ar0234_power(struct gs_ar0234_dev *sensor, int on);
 int gs_ar0234_version(struct gs_ar0234_dev *sensor, int type, u16 * version);
 int gs_read_serial(struct gs_ar0234_dev *sensor, u8 * buf);
+int gs_read_identity(struct gs_ar0234_dev *sensor, struct gs_ar0234_identity *id);
 int gs_set_password(struct gs_ar0234_dev *sensor, u16 password);
 int gs_restart(struct gs_ar0234_dev *sensor);
 int gs_start_bootloader(struct gs_ar0234_dev *sensor);